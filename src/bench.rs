@@ -0,0 +1,483 @@
+//! Headless benchmarks for world generation, meshing and culling, no X11 or GL needed.  Built
+//! instead of the game with `cargo run --release --features bench`.
+
+use std::alloc::{GlobalAlloc, Layout, System};
+use std::f32::consts::PI;
+use std::collections::HashMap;
+use std::sync::Arc;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use time;
+
+use cgmath::Point3;
+
+use cave::{CaveCulling, FaceConnectivity};
+use fov;
+use fov::{FAR_PLANE, Fov};
+use frustum::{ChunkBounds, Frustum};
+use mesh;
+use perlin;
+use region::{REGION_CHUNKS, Region};
+use world::{CHUNK_SIZE, Chunk, Neighborhood, Point2, World};
+
+/// Counts heap allocations made by the whole process, and tracks the most bytes live at once.
+struct CountingAllocator;
+
+static ALLOCATIONS: AtomicUsize = AtomicUsize::new(0);
+static LIVE_BYTES: AtomicUsize = AtomicUsize::new(0);
+static PEAK_BYTES: AtomicUsize = AtomicUsize::new(0);
+
+fn add_live(bytes: usize) {
+  let live = LIVE_BYTES.fetch_add(bytes, Ordering::Relaxed) + bytes;
+  let mut peak = PEAK_BYTES.load(Ordering::Relaxed);
+  while live > peak {
+    match PEAK_BYTES.compare_exchange(peak, live, Ordering::Relaxed, Ordering::Relaxed) {
+      Ok(_) => break,
+      Err(current) => peak = current,
+    }
+  }
+}
+
+unsafe impl GlobalAlloc for CountingAllocator {
+  unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+    ALLOCATIONS.fetch_add(1, Ordering::Relaxed);
+    add_live(layout.size());
+    System.alloc(layout)
+  }
+
+  unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+    LIVE_BYTES.fetch_sub(layout.size(), Ordering::Relaxed);
+    System.dealloc(ptr, layout)
+  }
+
+  unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+    ALLOCATIONS.fetch_add(1, Ordering::Relaxed);
+    LIVE_BYTES.fetch_sub(layout.size(), Ordering::Relaxed);
+    add_live(new_size);
+    System.realloc(ptr, layout, new_size)
+  }
+}
+
+#[global_allocator]
+static ALLOCATOR: CountingAllocator = CountingAllocator;
+
+/// World radii to generate and mesh whole worlds at.
+const RADII: [f32; 3] = [20.0, 40.0, FAR_PLANE];
+/// Chunks generated by the per-chunk perlin benchmark, each at a fresh position.
+const PERLIN_CHUNKS: i32 = 256;
+/// Times each neighborhood gets meshed.
+const MESH_ROUNDS: usize = 10;
+/// View directions the culling benchmark sweeps through.
+const VIEW_ANGLES: usize = 360;
+/// Chunk columns in each direction from the vertex for the large culling benchmark.
+const GRID_RADIUS: i32 = 30;
+
+/// Wall time and allocations of a measured run.
+struct Sample {
+  ns: u64,
+  allocations: usize,
+  /// Most heap bytes live at once during the run, above those live before it.
+  peak_bytes: usize,
+}
+
+fn measure<T, F: FnOnce() -> T>(f: F) -> (T, Sample) {
+  let allocations = ALLOCATIONS.load(Ordering::Relaxed);
+  let live_bytes = LIVE_BYTES.load(Ordering::Relaxed);
+  PEAK_BYTES.store(live_bytes, Ordering::Relaxed);
+  let start_ns = time::precise_time_ns();
+  let result = f();
+  let sample = Sample {
+    ns: time::precise_time_ns() - start_ns,
+    allocations: ALLOCATIONS.load(Ordering::Relaxed) - allocations,
+    peak_bytes: PEAK_BYTES.load(Ordering::Relaxed).saturating_sub(live_bytes),
+  };
+  (result, sample)
+}
+
+fn per_second(count: usize, ns: u64) -> f64 {
+  count as f64 * 1e9 / ns as f64
+}
+
+pub fn run() {
+  println!("Terrain: {:?}, mesher: {:?}", perlin::TERRAIN, mesh::MESHER);
+  for radius in RADII.iter() {
+    bench_world(*radius);
+  }
+  bench_perlin();
+  let world = generate_world(FAR_PLANE);
+  bench_mesh(&world);
+  bench_lod(&world);
+  bench_sides(&world);
+  bench_edits();
+  bench_facing_faces(&world);
+  bench_chunk_visible(&world);
+  bench_frustum(&world);
+  bench_caves(&world);
+  bench_regions(&world);
+  bench_angular_index();
+}
+
+/// Generates all chunks within the radius on this thread, the same way the loader would.
+fn generate_world(radius: f32) -> World {
+  let mut world = World::new(&Point2::new(0.0, 0.0), radius);
+  loop {
+    let requests = world.take_requests();
+    if requests.is_empty() {
+      break;
+    }
+    for chunk in requests {
+      let blocks = perlin::generate_blocks(&chunk.block_bounds());
+      world.insert(chunk, Arc::new(blocks));
+    }
+  }
+  world
+}
+
+fn neighborhoods(world: &mut World) -> Vec<Neighborhood> {
+  world.take_ready().iter().filter_map(|c| world.neighborhood(c)).collect()
+}
+
+fn bench_world(radius: f32) {
+  let ((chunks, blocks, vertices), sample) = measure(|| {
+    let mut world = generate_world(radius);
+    let mut scratch = mesh::MeshScratch::new();
+    let vertices: usize = neighborhoods(&mut world).iter()
+      .map(|n| mesh::create_mesh_vertices(&mut scratch, n, 0).coord_count())
+      .sum();
+    (world.chunk_count(), world.len(), vertices)
+  });
+  println!("World radius {:>4}: {:>4} chunks, {:>9.0} ns/chunk, {:>11.0} blocks/s, \
+    {:>11.0} vertices/s, {:>6} allocations, {:>6} KB peak heap", radius, chunks,
+    sample.ns as f64 / chunks as f64, per_second(blocks, sample.ns), per_second(vertices, sample.ns),
+    sample.allocations, sample.peak_bytes / 1024);
+}
+
+fn bench_perlin() {
+  // Far from the origin and from each other so no cached heightmap gets reused.
+  let chunks: Vec<Chunk> = (0..PERLIN_CHUNKS).map(|i| Chunk::new(1000 + i, 0, 1000)).collect();
+  let (blocks, sample) = measure(|| {
+    chunks.iter().map(|c| perlin::generate_blocks(&c.block_bounds()).len()).sum::<usize>()
+  });
+  println!("Perlin:            {:>4} chunks, {:>9.0} ns/chunk, {:>11.0} blocks/s, \
+    {:>6.1} allocations/chunk", chunks.len(), sample.ns as f64 / chunks.len() as f64,
+    per_second(blocks, sample.ns), sample.allocations as f64 / chunks.len() as f64);
+}
+
+fn bench_mesh(world: &World) {
+  let neighborhoods: Vec<Neighborhood> = world.chunks().filter_map(|c| world.neighborhood(c))
+    .collect();
+  let mut scratch = mesh::MeshScratch::new();
+  let (vertices, sample) = measure(|| {
+    let mut vertices = 0;
+    for _ in 0..MESH_ROUNDS {
+      for n in neighborhoods.iter() {
+        vertices += mesh::create_mesh_vertices(&mut scratch, n, 0).coord_count();
+      }
+    }
+    vertices
+  });
+  let meshed = neighborhoods.len() * MESH_ROUNDS;
+  println!("Mesh:             {:>5} chunks, {:>9.0} ns/chunk, {:>11.0} vertices/s, \
+    {:>6.1} allocations/chunk, {} vertices/chunk, {} KB peak heap", meshed,
+    sample.ns as f64 / meshed as f64, per_second(vertices, sample.ns),
+    sample.allocations as f64 / meshed as f64, vertices / meshed, sample.peak_bytes / 1024);
+}
+
+/// Meshes every chunk at each level of detail, then at the level its distance from the origin
+/// calls for.
+fn bench_lod(world: &World) {
+  let neighborhoods: Vec<Neighborhood> = world.chunks().filter_map(|c| world.neighborhood(c))
+    .collect();
+  let mut scratch = mesh::MeshScratch::new();
+  for lod in 0..mesh::LOD_DISTANCES.len() as u32 + 1 {
+    let (vertices, sample) = measure(|| {
+      neighborhoods.iter().map(|n| mesh::create_mesh_vertices(&mut scratch, n, lod).coord_count())
+        .sum::<usize>()
+    });
+    println!("LOD {}:            {:>5} chunks, {:>9.0} ns/chunk, {:>6} vertices/chunk", lod,
+      neighborhoods.len(), sample.ns as f64 / neighborhoods.len() as f64,
+      vertices / neighborhoods.len());
+  }
+  let (full, banded) = neighborhoods.iter().fold((0, 0), |(full, banded), n| {
+    let center = n.chunk.xz_center();
+    let lod = mesh::lod_for_distance((center.x * center.x + center.z * center.z).sqrt());
+    (full + mesh::create_mesh_vertices(&mut scratch, n, 0).coord_count(),
+      banded + mesh::create_mesh_vertices(&mut scratch, n, lod).coord_count())
+  });
+  println!("LOD bands:         {:>9} vertices, {:.1}% of full detail", banded,
+    100.0 * banded as f64 / full as f64);
+}
+
+/// Remeshes one side of every chunk and patches it into the full mesh, as after a neighbor
+/// arrives or leaves.
+fn bench_sides(world: &World) {
+  let neighborhoods: Vec<Neighborhood> = world.chunks().filter_map(|c| world.neighborhood(c))
+    .collect();
+  let mut scratch = mesh::MeshScratch::new();
+  let mut meshes: Vec<mesh::Vertices> = neighborhoods.iter()
+    .map(|n| mesh::create_mesh_vertices(&mut scratch, n, 0))
+    .collect();
+  let (_, sample) = measure(|| {
+    for (n, vertices) in neighborhoods.iter().zip(meshes.iter_mut()) {
+      *vertices = vertices.with_sides(1 << 1, &mesh::create_side_vertices(n, 1 << 1));
+    }
+  });
+  println!("Sides:             {:>4} chunks, {:>9.0} ns/chunk, {:>6.1} allocations/chunk",
+    neighborhoods.len(), sample.ns as f64 / neighborhoods.len() as f64,
+    sample.allocations as f64 / neighborhoods.len() as f64);
+}
+
+/// Removes a block from the middle of every chunk and remeshes the edited chunks, as the render
+/// thread does within its per-frame budget, then arranges each remesh like the old mesh to find
+/// the bytes patching its buffers uploads.  Snapshots for meshing are kept alive so every edit
+/// copies its chunk.
+fn bench_edits() {
+  let mut world = generate_world(FAR_PLANE);
+  let snapshots = neighborhoods(&mut world);
+  let mut scratch = mesh::MeshScratch::new();
+  let mut meshes: HashMap<Chunk, mesh::Vertices> = snapshots.iter()
+    .map(|n| (n.chunk.clone(), mesh::create_mesh_vertices(&mut scratch, n, 0)))
+    .collect();
+  let (edits, sample) = measure(|| {
+    for n in snapshots.iter() {
+      let min = n.chunk.block_bounds().min;
+      world.remove_block(&Point3::new(min.x + 8, min.y + 8, min.z + 8));
+    }
+    let edited = world.take_edited();
+    for c in edited.iter() {
+      let n = world.neighborhood(c).unwrap();
+      mesh::create_mesh_vertices(&mut scratch, &n, 0);
+    }
+    edited.len()
+  });
+  println!("Edits:             {:>4} chunks, {:>9.0} ns/edit, {:>6.1} allocations/edit", edits,
+    sample.ns as f64 / edits as f64, sample.allocations as f64 / edits as f64);
+
+  let (mut whole, mut patched) = (0, 0);
+  for n in snapshots.iter() {
+    let c = &n.chunk;
+    let old = meshes.remove(c).unwrap();
+    let remesh = mesh::create_mesh_vertices(&mut scratch, &world.neighborhood(c).unwrap(), 0);
+    whole += remesh.coord_count() * mesh::Coords::size_bytes() as usize;
+    let (_, changed) = remesh.arrange_like(&old);
+    patched += changed.iter().map(|&(_, _, quads)| 4 * quads as usize).sum::<usize>() *
+      mesh::Coords::size_bytes() as usize;
+  }
+  println!("Edit uploads:      {:>9.0} bytes/edit patched, {:>9.0} bytes/edit whole",
+    patched as f64 / edits as f64, whole as f64 / edits as f64);
+}
+
+/// Share of quads left to draw after skipping face directions which cannot face the eye.
+fn bench_facing_faces(world: &World) {
+  let eye = fov::eye_position(&world.eye().unwrap_or(Point3::new(0, 0, 0)));
+  let mut scratch = mesh::MeshScratch::new();
+  let meshes: Vec<mesh::Vertices> = world.chunks().filter_map(|c| world.neighborhood(c))
+    .map(|n| mesh::create_mesh_vertices(&mut scratch, &n, 0))
+    .collect();
+  let (mut total, mut facing) = (0, 0);
+  for m in meshes.iter() {
+    let faces = mesh::facing_faces(&m.origin(), m.extent() as f32, &eye);
+    for (i, &quads) in m.face_quads().iter().enumerate() {
+      total += quads;
+      if faces[i] {
+        facing += quads;
+      }
+    }
+  }
+  println!("Facing faces:   {:>7} quads, {:.1}% drawn", total, 100.0 * facing as f64 / total as f64);
+}
+
+fn bench_chunk_visible(world: &World) {
+  let chunks: Vec<Chunk> = world.chunks().cloned().collect();
+  let mut fov = Fov {
+    vertex: Point2::new(0.0, 0.0),
+    center_angle: 0.0,
+    view_angle: 70.0 * PI / 180.0,
+  };
+  let (visible, sample) = measure(|| {
+    let mut visible = 0;
+    for _ in 0..VIEW_ANGLES {
+      fov.inc_center_angle(2.0 * PI / VIEW_ANGLES as f32);
+      visible += chunks.iter().filter(|c| fov.chunk_visible(c)).count();
+    }
+    visible
+  });
+  let tests = chunks.len() * VIEW_ANGLES;
+  println!("Chunk visible:   {:>6} tests, {:>9.1} ns/test, {:.1}% visible, {} allocations", tests,
+    sample.ns as f64 / tests as f64, 100.0 * visible as f64 / tests as f64, sample.allocations);
+}
+
+fn bench_frustum(world: &World) {
+  let eye = world.eye().unwrap_or(Point3::new(0, 0, 0));
+  let mut bounds = ChunkBounds::new(&Point2::new(eye.x as f32, eye.z as f32));
+  for c in world.chunks() {
+    bounds.insert(c);
+  }
+  let mut fov = Fov {
+    vertex: Point2::new(0.0, 0.0),
+    center_angle: 0.0,
+    view_angle: 70.0 * PI / 180.0,
+  };
+  let mut visible_chunks = Vec::with_capacity(bounds.len());
+  let (visible, sample) = measure(|| {
+    let mut visible = 0;
+    for _ in 0..VIEW_ANGLES {
+      fov.inc_center_angle(2.0 * PI / VIEW_ANGLES as f32);
+      let mvp = fov.projection_matrix(1280, 720) * fov.view_matrix(&eye);
+      bounds.cull(&Frustum::new(&mvp), &fov, &mut visible_chunks);
+      visible += visible_chunks.len();
+    }
+    visible
+  });
+  let tests = bounds.len() * VIEW_ANGLES;
+  println!("Frustum:         {:>6} tests, {:>9.1} ns/test, {:.1}% visible, {} allocations", tests,
+    sample.ns as f64 / tests as f64, 100.0 * visible as f64 / tests as f64, sample.allocations);
+}
+
+/// Finds face connectivity of every chunk, then culls chunks hidden from the eye's chunk after
+/// frustum culling for a sweep of view directions.
+fn bench_caves(world: &World) {
+  let (connectivity, connectivity_sample) = measure(|| {
+    world.chunks().map(|c| {
+      let blocks = world.neighborhood(c).unwrap().blocks;
+      (c.clone(), FaceConnectivity::new(&blocks))
+    }).collect::<HashMap<Chunk, FaceConnectivity>>()
+  });
+  let eye = world.eye().unwrap_or(Point3::new(0, 0, 0));
+  let eye_position = fov::eye_position(&eye);
+  let eye_chunk = Chunk::of_block(&Point3::new(eye_position.x.round() as i32,
+    eye_position.y.round() as i32, eye_position.z.round() as i32));
+  let mut bounds = ChunkBounds::new(&Point2::new(eye.x as f32, eye.z as f32));
+  for c in world.chunks() {
+    bounds.insert(c);
+  }
+  let mut fov = Fov {
+    vertex: Point2::new(0.0, 0.0),
+    center_angle: 0.0,
+    view_angle: 70.0 * PI / 180.0,
+  };
+  let mut caves = CaveCulling::new();
+  let mut visible = Vec::with_capacity(bounds.len());
+  let (mut in_frustum, mut reachable) = (0, 0);
+  let (_, sample) = measure(|| {
+    for _ in 0..VIEW_ANGLES {
+      fov.inc_center_angle(2.0 * PI / VIEW_ANGLES as f32);
+      let frustum = Frustum::new(&(fov.projection_matrix(1280, 720) * fov.view_matrix(&eye)));
+      bounds.cull(&frustum, &fov, &mut visible);
+      in_frustum += visible.len();
+      caves.cull(&eye_chunk, &connectivity, &frustum, &mut visible);
+      reachable += visible.len();
+    }
+  });
+  println!("Caves:           {:>6} chunks, {:>9.0} ns/chunk connectivity, {:>7.0} ns/frame, \
+    {:.1}% of frustum visible chunks reachable", connectivity.len(),
+    connectivity_sample.ns as f64 / connectivity.len() as f64, sample.ns as f64 / VIEW_ANGLES as f64,
+    100.0 * reachable as f64 / in_frustum as f64);
+}
+
+/// Merges distant chunks into regions, then counts draw calls of frustum culled chunks for a
+/// sweep of view directions with and without regions.
+fn bench_regions(world: &World) {
+  let lod = |c: &Chunk| {
+    let center = c.xz_center();
+    mesh::lod_for_distance((center.x * center.x + center.z * center.z).sqrt())
+  };
+  let mut scratch = mesh::MeshScratch::new();
+  let mut members: HashMap<Region, Vec<(Chunk, mesh::Vertices)>> = HashMap::new();
+  for n in world.chunks().filter_map(|c| world.neighborhood(c)) {
+    let l = lod(&n.chunk);
+    if l > 0 {
+      let vertices = mesh::create_mesh_vertices(&mut scratch, &n, l);
+      members.entry(Region::of_chunk(&n.chunk)).or_insert_with(Vec::new)
+        .push((n.chunk.clone(), vertices));
+    }
+  }
+  let (merged, sample) = measure(|| {
+    members.iter().filter(|&(r, m)| {
+      let origin = r.origin();
+      let parts: Vec<(&mesh::Vertices, [u8; 3])> = m.iter().map(|&(ref c, ref v)| {
+        let o = c.block_bounds().min;
+        (v, [(o.x - origin.x) as u8, (o.y - origin.y) as u8, (o.z - origin.z) as u8])
+      }).collect();
+      m.len() > 1 && mesh::Vertices::merge(&origin, REGION_CHUNKS * CHUNK_SIZE, &parts).is_some()
+    }).map(|(r, _)| r.clone()).collect::<Vec<Region>>()
+  });
+
+  let eye = world.eye().unwrap_or(Point3::new(0, 0, 0));
+  let mut bounds = ChunkBounds::new(&Point2::new(eye.x as f32, eye.z as f32));
+  for c in world.chunks() {
+    bounds.insert(c);
+  }
+  let mut fov = Fov {
+    vertex: Point2::new(0.0, 0.0),
+    center_angle: 0.0,
+    view_angle: 70.0 * PI / 180.0,
+  };
+  let mut visible = Vec::new();
+  let mut drawn = Vec::new();
+  let (mut chunk_draws, mut region_draws) = (0, 0);
+  for _ in 0..VIEW_ANGLES {
+    fov.inc_center_angle(2.0 * PI / VIEW_ANGLES as f32);
+    let mvp = fov.projection_matrix(1280, 720) * fov.view_matrix(&eye);
+    bounds.cull(&Frustum::new(&mvp), &fov, &mut visible);
+    drawn.clear();
+    for c in visible.iter() {
+      let r = Region::of_chunk(c);
+      if lod(c) == 0 || !merged.contains(&r) {
+        region_draws += 1;
+      } else if !drawn.contains(&r) {
+        drawn.push(r);
+        region_draws += 1;
+      }
+    }
+    chunk_draws += visible.len();
+  }
+  println!("Regions:         {:>6} merged, {:>9.0} ns/region, {:.1} draws/frame, {:.1} without",
+    merged.len(), sample.ns as f64 / members.len() as f64,
+    region_draws as f64 / VIEW_ANGLES as f64, chunk_draws as f64 / VIEW_ANGLES as f64);
+}
+
+/// Culls a grid of chunk columns much larger than the view distance, per frame, with the existing
+/// `chunk_visible` loop, with frustum planes tested against every chunk, and with frustum planes
+/// tested only against chunks the angular index selects.
+fn bench_angular_index() {
+  let chunks: Vec<Chunk> = (-GRID_RADIUS..GRID_RADIUS + 1)
+    .flat_map(|x| (-GRID_RADIUS..GRID_RADIUS + 1).map(move |z| Chunk::new(x, 0, z)))
+    .collect();
+  let mut bounds = ChunkBounds::new(&Point2::new(0.0, 0.0));
+  for c in chunks.iter() {
+    bounds.insert(c);
+  }
+  let fov = Fov {
+    vertex: Point2::new(0.0, 0.0),
+    center_angle: 0.0,
+    view_angle: 70.0 * PI / 180.0,
+  };
+  let frames = VIEW_ANGLES / 10;
+  let frame_fovs: Vec<Fov> = (0..frames).map(|i| Fov {
+    center_angle: i as f32 * 2.0 * PI / frames as f32,
+    ..fov.clone()
+  }).collect();
+  let frustums: Vec<Frustum> = frame_fovs.iter().map(|f| {
+    Frustum::new(&(f.projection_matrix(1280, 720) * f.view_matrix(&Point3::new(0, 0, 0))))
+  }).collect();
+
+  let (_, loop_sample) = measure(|| {
+    frame_fovs.iter().map(|f| chunks.iter().filter(|c| f.chunk_visible(c)).count()).sum::<usize>()
+  });
+  let mut visible = Vec::with_capacity(chunks.len());
+  let (_, full_sample) = measure(|| {
+    for (f, frustum) in frame_fovs.iter().zip(frustums.iter()) {
+      let everything = Fov { view_angle: 2.0 * PI, ..f.clone() };
+      bounds.cull(frustum, &everything, &mut visible);
+    }
+  });
+  let (_, index_sample) = measure(|| {
+    for (f, frustum) in frame_fovs.iter().zip(frustums.iter()) {
+      bounds.cull(frustum, f, &mut visible);
+    }
+  });
+  let ns_per_frame = |sample: &Sample| sample.ns as f64 / frames as f64;
+  println!("Angular index:   {:>6} chunks, chunk_visible {:>9.0} ns/frame, full frustum {:>7.0} \
+    ns/frame, indexed frustum {:>6.0} ns/frame", chunks.len(), ns_per_frame(&loop_sample),
+    ns_per_frame(&full_sample), ns_per_frame(&index_sample));
+}
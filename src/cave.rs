@@ -0,0 +1,246 @@
+use std::collections::{HashMap, VecDeque};
+
+use frustum::Frustum;
+use world::{CHUNK_SIZE, CHUNK_VOLUME, Chunk, ChunkBlocks};
+
+/// Which pairs of a chunk's 6 faces, in `mesh::CUBE_FACES` order, are connected through empty
+/// blocks inside the chunk.  Bit 6 * a + b is set when faces a and b are.
+#[derive(Clone, Copy, Debug, PartialEq)]
+pub struct FaceConnectivity(u64);
+
+impl FaceConnectivity {
+  /// Every face connected with every other, as for an empty chunk.
+  pub fn all() -> FaceConnectivity {
+    FaceConnectivity((1 << 36) - 1)
+  }
+
+  /// Flood fills each region of empty blocks, faces touched by the same region are connected.
+  #[cfg(any(test, feature = "bench"))]
+  pub fn new(blocks: &ChunkBlocks) -> FaceConnectivity {
+    FaceConnectivity::with_scratch(blocks, &mut Vec::new(), &mut Vec::new())
+  }
+
+  /// Like `new`, flood filling in buffers kept from earlier chunks.
+  pub fn with_scratch(blocks: &ChunkBlocks, visited: &mut Vec<bool>,
+    stack: &mut Vec<(i32, i32, i32)>) -> FaceConnectivity {
+
+    if blocks.len() == 0 {
+      return FaceConnectivity::all();
+    }
+    let mut bits = 0;
+    visited.clear();
+    visited.resize(CHUNK_VOLUME, false);
+    stack.clear();
+    let index = |x: i32, y: i32, z: i32| ((y * CHUNK_SIZE + z) * CHUNK_SIZE + x) as usize;
+    for y in 0..CHUNK_SIZE {
+      for z in 0..CHUNK_SIZE {
+        for x in 0..CHUNK_SIZE {
+          if visited[index(x, y, z)] || blocks.contains_local(x, y, z) {
+            continue;
+          }
+          visited[index(x, y, z)] = true;
+          stack.push((x, y, z));
+          let mut faces = 0u32;
+          while let Some((x, y, z)) = stack.pop() {
+            faces |= faces_touched(x, y, z);
+            for &(dx, dy, dz) in [(-1, 0, 0), (1, 0, 0), (0, -1, 0), (0, 1, 0), (0, 0, -1),
+                (0, 0, 1)].iter() {
+              let (nx, ny, nz) = (x + dx, y + dy, z + dz);
+              if ChunkBlocks::in_chunk(nx, ny, nz) && !visited[index(nx, ny, nz)] &&
+                !blocks.contains_local(nx, ny, nz) {
+                visited[index(nx, ny, nz)] = true;
+                stack.push((nx, ny, nz));
+              }
+            }
+          }
+          for a in 0..6 {
+            for b in 0..6 {
+              if faces & (1 << a) != 0 && faces & (1 << b) != 0 {
+                bits |= 1 << (6 * a + b);
+              }
+            }
+          }
+        }
+      }
+    }
+    FaceConnectivity(bits)
+  }
+
+  pub fn connected(&self, a: usize, b: usize) -> bool {
+    self.0 & (1 << (6 * a + b)) != 0
+  }
+}
+
+/// Faces of the chunk the local block (x, y, z) is on, as a bit mask.
+fn faces_touched(x: i32, y: i32, z: i32) -> u32 {
+  let last = CHUNK_SIZE - 1;
+  (x == 0) as u32 | ((x == last) as u32) << 1 | ((y == 0) as u32) << 2 |
+    ((y == last) as u32) << 3 | ((z == 0) as u32) << 4 | ((z == last) as u32) << 5
+}
+
+/// The face opposite to face i, faces come in pairs in `mesh::CUBE_FACES` order.
+fn opposite(i: usize) -> usize {
+  i ^ 1
+}
+
+/// Culls chunks the eye cannot see into through empty blocks, like the insides of hills.  Walks
+/// from the eye's chunk to neighbors through faces connected inside each chunk, never stepping
+/// back against a direction already taken and only into chunks intersecting the frustum.  Chunks
+/// without known connectivity, not loaded or not meshed yet, count as empty.  Each chunk is
+/// entered through every face a walk reaches it by, so chunks seen along a line of sight are kept.
+pub struct CaveCulling {
+  /// Chunk, face it was entered through and directions taken to get there as a bit mask.
+  queue: VecDeque<(Chunk, usize, u32)>,
+  /// Chunks reached, with the sets of directions taken by walks queued through each face, as a bit
+  /// per set.
+  reached: HashMap<Chunk, [u64; 6]>,
+}
+
+impl CaveCulling {
+  pub fn new() -> CaveCulling {
+    CaveCulling {
+      queue: VecDeque::new(),
+      reached: HashMap::new(),
+    }
+  }
+
+  /// Removes chunks not reachable from the eye's chunk from visible, keeping the order of the
+  /// others.
+  pub fn cull(&mut self, eye: &Chunk, connectivity: &HashMap<Chunk, FaceConnectivity>,
+    frustum: &Frustum, visible: &mut Vec<Chunk>) {
+
+    self.queue.clear();
+    self.reached.clear();
+    self.reached.insert(eye.clone(), [0; 6]);
+    for (i, n) in eye.neighbors().iter().enumerate() {
+      self.step(n, opposite(i), 1 << i, frustum);
+    }
+    while let Some((chunk, entered, directions)) = self.queue.pop_front() {
+      let c = connectivity.get(&chunk).cloned().unwrap_or(FaceConnectivity::all());
+      for (i, n) in chunk.neighbors().iter().enumerate() {
+        if i != entered && directions & (1 << opposite(i)) == 0 && c.connected(entered, i) {
+          self.step(n, opposite(i), directions | 1 << i, frustum);
+        }
+      }
+    }
+    let reached = &self.reached;
+    visible.retain(|c| reached.contains_key(c));
+  }
+
+  fn step(&mut self, chunk: &Chunk, entered: usize, directions: u32, frustum: &Frustum) {
+    // A walk in through the same face with a subset of the directions taken goes on wherever this
+    // one can.  Directions hold at most one of each opposite pair, so there are at most 8 subsets.
+    let walks = match self.reached.get(chunk) {
+      Some(walks) => walks[entered],
+      None if frustum.intersects_chunk(chunk) => 0,
+      None => return,
+    };
+    let mut taken = directions;
+    loop {
+      if walks & (1 << taken) != 0 {
+        return;
+      }
+      if taken == 0 {
+        break;
+      }
+      taken = (taken - 1) & directions;
+    }
+    self.reached.entry(chunk.clone()).or_insert([0; 6])[entered] |= 1 << directions;
+    self.queue.push_back((chunk.clone(), entered, directions));
+  }
+}
+
+#[cfg(test)]
+mod tests {
+  use std::collections::HashMap;
+  use std::f32::consts::PI;
+  use cgmath::Point3;
+  use fov::Fov;
+  use frustum::Frustum;
+  use world::{Block, Chunk, ChunkBlocks, Point2, SOLID};
+  use super::{CaveCulling, FaceConnectivity};
+
+  /// A solid floor through the middle separates the faces above it from those below.
+  #[test]
+  fn floor_splits_up_from_down() {
+    let bounds = Chunk::new(0, 0, 0).block_bounds();
+    let mut blocks = ChunkBlocks::new(&bounds);
+    for z in bounds.min.z..bounds.max.z + 1 {
+      for x in bounds.min.x..bounds.max.x + 1 {
+        blocks.set(&Block::new(x, 0, z), SOLID);
+      }
+    }
+    let c = FaceConnectivity::new(&blocks);
+    assert!(!c.connected(2, 3));
+    assert!(c.connected(0, 1) && c.connected(4, 5) && c.connected(0, 3) && c.connected(2, 5));
+    assert_eq!(FaceConnectivity::all(), FaceConnectivity::new(&ChunkBlocks::new(&bounds)));
+  }
+
+  /// Looking along -z from inside chunk (0, 0, 0), a solid chunk hides the one behind it.
+  #[test]
+  fn solid_chunk_hides_chunk_behind() {
+    let fov = Fov {
+      vertex: Point2::new(0.0, 0.0),
+      center_angle: 0.0,
+      view_angle: PI / 2.0,
+    };
+    let frustum = Frustum::new(&(fov.projection_matrix(800, 600) *
+      fov.view_matrix(&Point3::new(0, 0, 0))));
+    let mut connectivity = HashMap::new();
+    for x in -3..4 {
+      for y in -1..2 {
+        for z in -4..1 {
+          connectivity.insert(Chunk::new(x, y, z), FaceConnectivity(0));
+        }
+      }
+    }
+    let eye = Chunk::new(0, 0, 0);
+    connectivity.insert(eye.clone(), FaceConnectivity::all());
+    connectivity.insert(Chunk::new(0, 0, -2), FaceConnectivity::all());
+    let chunks = vec![eye.clone(), Chunk::new(0, 0, -1), Chunk::new(0, 0, -2)];
+
+    let mut culling = CaveCulling::new();
+    let mut visible = chunks.clone();
+    culling.cull(&eye, &connectivity, &frustum, &mut visible);
+    assert_eq!(&chunks[..2], &visible[..]);
+
+    // A tunnel through the solid chunk.
+    connectivity.insert(Chunk::new(0, 0, -1), FaceConnectivity::all());
+    let mut visible = chunks.clone();
+    culling.cull(&eye, &connectivity, &frustum, &mut visible);
+    assert_eq!(chunks, visible);
+  }
+
+  /// A chunk first entered through a face leading nowhere is entered again through one leading
+  /// on.
+  #[test]
+  fn chunk_is_entered_through_each_face() {
+    let fov = Fov {
+      vertex: Point2::new(0.0, 0.0),
+      center_angle: 0.0,
+      view_angle: PI / 2.0,
+    };
+    let frustum = Frustum::new(&(fov.projection_matrix(800, 600) *
+      fov.view_matrix(&Point3::new(0, 0, 0))));
+    let mut connectivity = HashMap::new();
+    for x in -3..4 {
+      for y in -1..2 {
+        for z in -4..1 {
+          connectivity.insert(Chunk::new(x, y, z), FaceConnectivity(0));
+        }
+      }
+    }
+    let eye = Chunk::new(0, 0, 0);
+    connectivity.insert(eye.clone(), FaceConnectivity::all());
+    connectivity.insert(Chunk::new(1, 0, 0), FaceConnectivity::all());
+    connectivity.insert(Chunk::new(0, 0, -1), FaceConnectivity::all());
+    // Its left face leads on to the back, the front one, reached first from (1, 0, 0), nowhere.
+    connectivity.insert(Chunk::new(1, 0, -1), FaceConnectivity(1 << 4 | 1 << 24));
+    let behind = Chunk::new(1, 0, -2);
+
+    let mut culling = CaveCulling::new();
+    let mut visible = vec![behind.clone()];
+    culling.cull(&eye, &connectivity, &frustum, &mut visible);
+    assert_eq!(vec![behind], visible);
+  }
+}
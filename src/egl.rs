@@ -1,6 +1,7 @@
 extern crate libc;
 
-use libc::{c_uint, c_void};
+use libc::{c_char, c_uint, c_void};
+use std::ffi::CString;
 use std::ptr;
 use std::result::Result;
 use std::vec::Vec;
@@ -387,8 +388,17 @@ pub fn terminate(display: Display) -> Result<(), Error> {
   }
 }
 
+/// Address of a client API function, null if there is no such function.
+pub fn get_proc_address(proc_name: &str) -> *const c_void {
+  let c_proc_name = CString::new(proc_name).unwrap();
+  unsafe {
+    eglGetProcAddress(c_proc_name.as_ptr())
+  }
+}
+
 #[link(name = "EGL")]
 extern {
+  fn eglGetProcAddress(proc_name: *const c_char) -> *const c_void;
   fn eglGetDisplay(display_id: NativeDisplayType) -> Display;
   fn eglInitialize(display: Display, major: *mut Int, minor: *mut Int) -> Boolean;
   fn eglChooseConfig(display: Display, attrib_list: *const Int, configs: *mut Config,
@@ -1,25 +1,40 @@
 extern crate cgmath;
 extern crate png;
 
-use std::collections::HashMap;
+use std::collections::{HashMap, VecDeque};
 use std::default::Default;
 use std::f32::consts::PI;
 use time;
 
-use cgmath::Matrix4;
+use cgmath::{Matrix4, Point3};
 use fps::{Fps, Stats};
 
 #[cfg(target_os = "android")]
 use egl_context::EglContext;
+use cave::{CaveCulling, FaceConnectivity};
+use fov;
 use fov::{FAR_PLANE, Fov};
+use frustum::{ChunkBounds, Frustum};
 use gl;
 use gl::Texture;
+use loader::{Loaded, Loader};
 use mesh;
+use mesh::{MeshScratch, Vertices};
 use program::{Buffers, Program};
-use world::{Chunk, Point2, World};
+use region::{Region, Regions};
+use tracker::{MeshTracker, Work};
+use world::{Block, Chunk, Point2, World};
 #[cfg(target_os = "linux")]
 use x11::{PollEventsIterator, XWindow};
 
+/// Maximum number of chunk meshes uploaded to GPU per frame, keeps frames short while chunks are
+/// loading.
+const MAX_UPLOADS_PER_FRAME: usize = 2;
+
+/// Time the render thread may spend per frame remeshing chunks with edited blocks, a fraction of
+/// a 60 FPS frame.
+const EDIT_BUDGET_NS: u64 = 2000000;
+
 #[cfg(target_os = "android")]
 pub struct EngineImpl {
   pub egl_context: Option<Box<EglContext>>,
@@ -51,7 +66,16 @@ pub struct Engine {
   /// Texture atlas.
   texture: Texture,
   world: World,
-  buffers: HashMap<Chunk, Buffers>,
+  /// Generates and meshes chunks in the background.
+  loader: Loader,
+  /// When world loading started, `None` once all chunks have been uploaded.
+  loading_since_s: Option<f64>,
+  chunks: ChunkMeshes,
+  caves: CaveCulling,
+  /// Regions drawn so far this frame.
+  drawn_regions: Vec<Region>,
+  /// Chunks passing frustum culling, refilled every frame.
+  visible: Vec<Chunk>,
   fps: Fps,
 }
 
@@ -67,18 +91,22 @@ impl Engine {
   #[cfg(target_os = "android")]
   pub fn new() -> Engine {
     use cgmath::SquareMatrix;
+    let fov = Engine::initial_fov();
+    let loader = Loader::new(&fov);
+    let chunks = ChunkMeshes::new(&fov);
     Engine {
       engine_impl: Default::default(),
       animating: false,
-      fov: Fov {
-        vertex: Point2::new(0.0, 0.0),
-        center_angle: 0f32.to_rad(),
-        view_angle: 70f32.to_rad(),
-      },
+      fov: fov,
       projection_matrix: Matrix4::identity(),
       texture: Default::default(),
       world: World::new(&Point2::new(0.0, 0.0), FAR_PLANE),
-      buffers: HashMap::new(),
+      loader: loader,
+      loading_since_s: Some(time::precise_time_s()),
+      chunks: chunks,
+      caves: CaveCulling::new(),
+      drawn_regions: Vec::new(),
+      visible: Vec::new(),
       fps: Fps::stopped(),
     }
   }
@@ -86,25 +114,37 @@ impl Engine {
   #[cfg(target_os = "linux")]
   pub fn new(window: XWindow, program: Program) -> Engine {
     use cgmath::SquareMatrix;
+    let fov = Engine::initial_fov();
+    let loader = Loader::new(&fov);
+    let chunks = ChunkMeshes::new(&fov);
     Engine {
       engine_impl: EngineImpl {
         window: window,
         program: program,
       },
       animating: false,
-      fov: Fov {
-        vertex: Point2::new(0.0, 0.0),
-        center_angle: 0f32.to_rad(),
-        view_angle: 70f32.to_rad(),
-      },
+      fov: fov,
       projection_matrix: Matrix4::identity(),
       texture: Default::default(),
       world: World::new(&Point2::new(0.0, 0.0), FAR_PLANE),
-      buffers: HashMap::new(),
+      loader: loader,
+      loading_since_s: Some(time::precise_time_s()),
+      chunks: chunks,
+      caves: CaveCulling::new(),
+      drawn_regions: Vec::new(),
+      visible: Vec::new(),
       fps: Fps::stopped(),
     }
   }
 
+  fn initial_fov() -> Fov {
+    Fov {
+      vertex: Point2::new(0.0, 0.0),
+      center_angle: 0f32.to_rad(),
+      view_angle: 70f32.to_rad(),
+    }
+  }
+
   /// Initialize the engine.
   #[cfg(target_os = "android")]
   pub fn init(&mut self, egl_context: Box<EglContext>, texture_atlas_bytes: &[u8]) {
@@ -153,43 +193,34 @@ impl Engine {
     self.texture = Engine::load_texture_atlas(texture_atlas_bytes);
     gl::active_texture(gl::TEXTURE0);
     gl::bind_texture_2d(self.texture);
-
-    self.load_meshes();
   }
 
+  /// Uploads chunk meshes finished in the background, a few per frame.
   #[cfg(target_os = "android")]
   fn load_meshes(&mut self) {
-    let start_s = time::precise_time_s();
-    log!("*** Loading meshes...");
-
-    if let Some(ref mut p) = self.engine_impl.program {
-      for (c, bs) in self.world.chunk_blocks() {
-        let vertices = mesh::create_mesh_vertices(bs, &self.world);
-        let buffers = p.upload_vertices(&vertices);
-        let c = (*c).clone();
-        self.buffers.insert(c, buffers);
-      }
+    if let Some(ref p) = self.engine_impl.program {
+      self.chunks.load(p, &self.fov, &mut self.world, &self.loader);
     }
-
-    let spent_ms = (time::precise_time_s() - start_s) * 1000.0;
-    log!("*** Loaded meshes: {:.3}ms, {} chunks", spent_ms, self.buffers.len());
+    self.log_loaded();
   }
 
+  /// Uploads chunk meshes finished in the background, a few per frame.
   #[cfg(target_os = "linux")]
   fn load_meshes(&mut self) {
-    let start_s = time::precise_time_s();
-    log!("*** Loading meshes...");
+    self.chunks.load(&self.engine_impl.program, &self.fov, &mut self.world, &self.loader);
+    self.log_loaded();
+  }
 
-    let p = &self.engine_impl.program;
-    for (c, bs) in self.world.chunk_blocks() {
-      let vertices = mesh::create_mesh_vertices(bs, &self.world);
-      let buffers = p.upload_vertices(&vertices);
-      let c = (*c).clone();
-      self.buffers.insert(c, buffers);
+  /// Logs how long loading took once all requested chunks are uploaded.
+  fn log_loaded(&mut self) {
+    if let Some(start_s) = self.loading_since_s {
+      if !self.world.is_loading() && self.chunks.buffers.len() == self.world.chunk_count() {
+        let spent_ms = (time::precise_time_s() - start_s) * 1000.0;
+        log!("*** Loaded world: {:.3}ms, {} chunks, {} blocks", spent_ms, self.chunks.buffers.len(),
+          self.world.len());
+        self.loading_since_s = None;
+      }
     }
-
-    let spent_ms = (time::precise_time_s() - start_s) * 1000.0;
-    log!("*** Loaded meshes: {:.3}ms, {} chunks", spent_ms, self.buffers.len());
   }
 
   pub fn set_viewport(&mut self, w: i32, h: i32) {
@@ -217,7 +248,13 @@ impl Engine {
 
     let texture = gl::gen_texture();
     gl::bind_texture_2d(texture);
-    gl::texture_2d_param(gl::TEXTURE_MIN_FILTER, gl::NEAREST_MIPMAP_LINEAR);
+    // Without gradients in the shader mipmaps would seam at every block edge of merged quads.
+    let min_filter = if gl::has_texture_gradients() {
+      gl::NEAREST_MIPMAP_LINEAR
+    } else {
+      gl::NEAREST
+    };
+    gl::texture_2d_param(gl::TEXTURE_MIN_FILTER, min_filter);
     gl::texture_2d_param(gl::TEXTURE_MAG_FILTER, gl::NEAREST);
     gl::texture_2d_param(gl::TEXTURE_WRAP_S, gl::CLAMP_TO_EDGE);
     gl::texture_2d_param(gl::TEXTURE_WRAP_T, gl::CLAMP_TO_EDGE);
@@ -247,15 +284,16 @@ impl Engine {
               // is always identity so instead of MVP = P * V * M just do MVP = P * V.
               let mvp_matrix = self.projection_matrix * self.fov.view_matrix(&e);
               p.set_mvp_matrix(mvp_matrix);
-
-              // Finally, draw the cube mesh for all visible chunks.
-              for (ch, bs) in self.buffers.iter() {
-                if self.fov.chunk_visible(ch) {
-                  p.bind_buffers(bs);
-                  gl::draw_elements_triangles_u16(bs.index_count);
-                  p.unbind_buffers();
-                }
-              }
+              let eye = fov::eye_position(&e);
+
+              // Finally, draw the cube mesh for all chunks within the view frustum.
+              let frustum = Frustum::new(&mvp_matrix);
+              let chunks = &mut self.chunks;
+              chunks.bounds.cull(&frustum, &self.fov, &mut self.visible);
+              self.caves.cull(&eye_chunk(&e), &chunks.connectivity, &frustum, &mut self.visible);
+              draw_chunks(p, &eye, &self.visible, &chunks.buffers, &chunks.regions,
+                &mut self.drawn_regions);
+              p.query_occlusion(self.visible.iter().filter_map(|c| chunks.buffers.get(c)), &eye);
             }
           },
           None => panic!("Missing program, should never happen"),
@@ -282,15 +320,16 @@ impl Engine {
       // is always identity so instead of MVP = P * V * M just do MVP = P * V.
       let mvp_matrix = self.projection_matrix * self.fov.view_matrix(&e);
       p.set_mvp_matrix(mvp_matrix);
-
-      // Finally, draw the cube meshes for all visible chunks.
-      for (ch, bs) in self.buffers.iter() {
-        if self.fov.chunk_visible(ch) {
-          p.bind_buffers(bs);
-          gl::draw_elements_triangles_u16(bs.index_count);
-          p.unbind_buffers();
-        }
-      }
+      let eye = fov::eye_position(&e);
+
+      // Finally, draw the cube meshes for all chunks within the view frustum.
+      let frustum = Frustum::new(&mvp_matrix);
+      let chunks = &mut self.chunks;
+      chunks.bounds.cull(&frustum, &self.fov, &mut self.visible);
+      self.caves.cull(&eye_chunk(&e), &chunks.connectivity, &frustum, &mut self.visible);
+      draw_chunks(p, &eye, &self.visible, &chunks.buffers, &chunks.regions,
+        &mut self.drawn_regions);
+      p.query_occlusion(self.visible.iter().filter_map(|c| chunks.buffers.get(c)), &eye);
     }
 
     self.engine_impl.window.swap_buffers();
@@ -299,6 +338,8 @@ impl Engine {
 
   /// Update for time passed and draw a frame.
   pub fn update_draw(&mut self) {
+    self.load_meshes();
+
     if self.animating {
       // Done processing events; draw next animation frame.
       // Do a complete rotation every 10 seconds, assuming 60 FPS.
@@ -312,10 +353,27 @@ impl Engine {
     }
   }
 
+  /// Moves the eye forward along the FOV center ray, backward for negative distance.
+  #[allow(dead_code)]
+  pub fn walk(&mut self, distance: f32) {
+    let (s, c) = self.fov.center_angle.sin_cos();
+    self.fov.vertex = Point2::new(self.fov.vertex.x + distance * s, self.fov.vertex.z - distance * c);
+    self.world.move_eye(&self.fov.vertex);
+    // The frustum's apex is at the eye block.
+    if let Some(e) = self.world.eye() {
+      self.chunks.bounds.set_vertex(&Point2::new(e.x as f32, e.z as f32));
+    }
+  }
+
   /// Terminate the engine.
   #[cfg(target_os = "android")]
   pub fn term(&mut self) {
     self.lost_focus();
+    // Chunk buffers live in the program's vertex pool and die with the context, chunks get meshed
+    // again once there is a new one.
+    self.chunks = ChunkMeshes::new(&self.fov);
+    self.loader.cancel_all_meshing();
+    self.world.ready_all();
     // Drop the program and the EGL context.
     self.engine_impl = Default::default();
     log!("*** Renderer terminated");
@@ -351,6 +409,275 @@ impl Engine {
 
 }
 
+/// Chunk meshes on the GPU, and what keeps them in step with the world.
+struct ChunkMeshes {
+  buffers: HashMap<Chunk, Buffers>,
+  /// Meshing asked for and running for each ready chunk.
+  tracker: MeshTracker,
+  /// Latest mesh of each chunk in `buffers`, for patching sides and merging regions.
+  meshes: HashMap<Chunk, Vertices>,
+  /// Face connectivity of meshed chunks, for cave culling.
+  connectivity: HashMap<Chunk, FaceConnectivity>,
+  /// Merged meshes of distant chunks.
+  regions: Regions,
+  /// Bounding boxes of chunks in `buffers`, for frustum culling.
+  bounds: ChunkBounds,
+  /// Chunks with edited blocks or sides facing them waiting to be remeshed on the render thread.
+  edited: VecDeque<(Chunk, Work)>,
+  scratch: MeshScratch,
+}
+
+impl ChunkMeshes {
+  fn new(fov: &Fov) -> ChunkMeshes {
+    ChunkMeshes {
+      buffers: HashMap::new(),
+      tracker: MeshTracker::new(),
+      meshes: HashMap::new(),
+      connectivity: HashMap::new(),
+      regions: Regions::new(),
+      bounds: ChunkBounds::new(&fov.vertex),
+      edited: VecDeque::new(),
+      scratch: MeshScratch::new(),
+    }
+  }
+
+  /// Hands chunk requests to background threads, feeds generated chunks into the world and
+  /// uploads up to `MAX_UPLOADS_PER_FRAME` finished meshes.  Chunk generation is prioritized for
+  /// the current view, chunks whose distance from the FOV vertex crossed a level of detail band
+  /// get remeshed and chunks whose neighbors arrived or left get the sides facing them remeshed.
+  /// Chunks with edited blocks are remeshed right away, see `remesh_edited`.  Meshes of distant
+  /// chunks are also merged into regions.
+  fn load(&mut self, program: &Program, fov: &Fov, world: &mut World, loader: &Loader) {
+    loader.set_view(fov);
+    for c in world.take_unloaded() {
+      loader.cancel(&c);
+      if let Some(bs) = self.buffers.remove(&c) {
+        program.release(bs);
+      }
+      self.tracker.remove(&c);
+      self.meshes.remove(&c);
+      self.connectivity.remove(&c);
+      self.regions.remove(program, &c);
+      self.bounds.remove(&c);
+      self.edited.retain(|e| e.0 != c);
+    }
+    self.remesh_edited(program, fov, world, loader);
+    self.regions.update(program, &self.meshes);
+
+    // The old mesh keeps being drawn until the new one is uploaded.
+    for (c, lod) in self.tracker.changed_lods(|c, lod| chunk_lod(c, fov, Some(lod))) {
+      if self.tracker.request_mesh(&c, lod) {
+        queue_mesh_work(loader, world, &mut self.tracker, &c, Work::Mesh(lod));
+      }
+    }
+
+    let mut uploads = 0;
+    loop {
+      for c in world.take_requests() {
+        loader.generate(c);
+      }
+      for c in world.take_ready() {
+        // Already meshed if edited since it got ready.
+        if self.meshes.contains_key(&c) {
+          continue;
+        }
+        let lod = chunk_lod(&c, fov, None);
+        if self.tracker.request_mesh(&c, lod) {
+          queue_mesh_work(loader, world, &mut self.tracker, &c, Work::Mesh(lod));
+        }
+      }
+      for (c, side) in world.take_border_changes() {
+        if self.tracker.request_side(&c, side) {
+          queue_mesh_work(loader, world, &mut self.tracker, &c, Work::Sides(1 << side));
+        }
+      }
+
+      if uploads >= MAX_UPLOADS_PER_FRAME {
+        return;
+      }
+      // Skip results for chunks unloaded while being meshed.
+      let meshed = match loader.try_recv() {
+        Some(Loaded::Generated(c, blocks)) => {
+          world.insert(c, blocks);
+          None
+        },
+        // Results of jobs superseded by edits only finish the job.
+        Some(Loaded::Meshed(c, job, vertices)) => {
+          if world.contains_chunk(&c) && self.tracker.is_awaited(&c, job) {
+            let current = self.tracker.is_current(&c);
+            Some((c, if current { Some(vertices) } else { None }))
+          } else {
+            None
+          }
+        },
+        Some(Loaded::SidesMeshed(c, job, sides, side_vertices)) => {
+          if world.contains_chunk(&c) && self.tracker.is_awaited(&c, job) {
+            let vertices = match self.meshes.get(&c) {
+              Some(v) if self.tracker.is_current(&c) => Some(v.with_sides(sides, &side_vertices)),
+              _ => None,
+            };
+            Some((c, vertices))
+          } else {
+            None
+          }
+        },
+        None => return,
+      };
+      if let Some((c, vertices)) = meshed {
+        if let Some(vertices) = vertices {
+          self.upload(program, &c, vertices);
+        }
+        uploads += 1;
+        if let Some(work) = self.tracker.finished(&c) {
+          queue_mesh_work(loader, world, &mut self.tracker, &c, work);
+        }
+      }
+    }
+  }
+
+  /// Remeshes chunks with edited blocks and the sides of their neighbors facing them on this
+  /// thread, so edits show in the next frame without waiting behind queued jobs and without
+  /// seams.  Meshing an edited chunk supersedes its background work.  Stops once
+  /// `EDIT_BUDGET_NS` is spent, the rest waits for the next frame.
+  fn remesh_edited(&mut self, program: &Program, fov: &Fov, world: &mut World, loader: &Loader) {
+    for c in world.take_edited() {
+      let lod = chunk_lod(&c, fov, self.tracker.lod(&c));
+      self.push_edit(c, Work::Mesh(lod));
+    }
+    for (c, side) in world.take_edited_sides() {
+      self.push_edit(c, Work::Sides(1 << side));
+    }
+    let start_ns = time::precise_time_ns();
+    while time::precise_time_ns() - start_ns < EDIT_BUDGET_NS {
+      let (c, work) = match self.edited.pop_front() {
+        Some(edit) => edit,
+        None => return,
+      };
+      match work {
+        Work::Mesh(lod) => {
+          let n = match world.neighborhood(&c) {
+            Some(n) => n,
+            None => continue,
+          };
+          let dropped = loader.cancel_meshing(&c);
+          self.tracker.meshed_now(&c, lod, dropped);
+          let vertices = mesh::create_mesh_vertices(&mut self.scratch, &n, lod);
+          self.upload(program, &c, vertices);
+        },
+        Work::Sides(sides) => self.remesh_edited_sides(program, world, &c, sides),
+      }
+    }
+  }
+
+  /// Queues edit work for a chunk, merged with work already waiting for it.  A full remesh
+  /// covers the sides.
+  fn push_edit(&mut self, chunk: Chunk, work: Work) {
+    if let Some(edit) = self.edited.iter_mut().find(|e| e.0 == chunk) {
+      match (edit.1, work) {
+        (Work::Sides(waiting), Work::Sides(sides)) => edit.1 = Work::Sides(waiting | sides),
+        (Work::Sides(_), Work::Mesh(lod)) => edit.1 = Work::Mesh(lod),
+        (Work::Mesh(_), _) => {},
+      }
+      return;
+    }
+    self.edited.push_back((chunk, work));
+  }
+
+  /// Patches sides of a chunk's full detail mesh on this thread.  Coarser meshes do not depend on
+  /// their neighbors.  A chunk with a job out gets the sides remeshed in the background after it
+  /// instead, so results keep their order.
+  fn remesh_edited_sides(&mut self, program: &Program, world: &World, c: &Chunk, sides: u32) {
+    if self.tracker.is_running(c) {
+      for side in (0..6).filter(|side| sides & 1 << side != 0) {
+        // Only records the side while the job is out.
+        self.tracker.request_side(c, side);
+      }
+      return;
+    }
+    let patched = match self.meshes.get(c) {
+      Some(vertices) if vertices.lod() == 0 => world.neighborhood(c)
+        .map(|n| vertices.with_sides(sides, &mesh::create_side_vertices(&n, sides))),
+      _ => None,
+    };
+    if let Some(vertices) = patched {
+      self.upload(program, c, vertices);
+    }
+  }
+
+  /// Uploads a chunk's latest mesh in place of the old one, patching the old one's buffers where
+  /// it can.
+  fn upload(&mut self, program: &Program, c: &Chunk, vertices: Vertices) {
+    self.bounds.insert(c);
+    self.connectivity.insert(c.clone(), vertices.connectivity());
+    let old = self.meshes.remove(c);
+    let (buffers, vertices) = program.update_vertices(self.buffers.remove(c), old.as_ref(),
+      vertices);
+    self.buffers.insert(c.clone(), buffers);
+    // Full detail meshes are near the eye and change level of detail soonest.
+    if vertices.lod() > 0 {
+      self.regions.insert(program, c.clone());
+    } else {
+      self.regions.remove(program, c);
+    }
+    self.meshes.insert(c.clone(), vertices);
+  }
+}
+
+/// Queues meshing work for a generated chunk, on a snapshot of it and its neighbors, and tells
+/// the tracker which job to wait for.
+fn queue_mesh_work(loader: &Loader, world: &World, tracker: &mut MeshTracker, chunk: &Chunk,
+  work: Work) {
+
+  if let Some(n) = world.neighborhood(chunk) {
+    let job = match work {
+      Work::Mesh(lod) => loader.mesh(n, lod),
+      Work::Sides(sides) => loader.mesh_sides(n, sides),
+    };
+    tracker.started(chunk, job);
+  }
+}
+
+/// Draws visible chunks, those in a merged region through the region's mesh, once per frame.  A
+/// region is skipped if occlusion queries found each of its visible chunks hidden.
+fn draw_chunks(program: &Program, eye: &Point3<f32>, visible: &[Chunk],
+  buffers: &HashMap<Chunk, Buffers>, regions: &Regions, drawn: &mut Vec<Region>) {
+
+  drawn.clear();
+  for c in visible.iter() {
+    if let Some(bs) = buffers.get(c) {
+      match regions.get(c) {
+        Some(merged) => {
+          let region = Region::of_chunk(c);
+          if !drawn.contains(&region) && !program.is_hidden(bs, eye) {
+            program.draw(merged, eye);
+            drawn.push(region);
+          }
+        },
+        None => program.draw(bs, eye),
+      }
+    }
+  }
+  program.unbind_buffers();
+}
+
+/// Chunk the eye standing on block e is in.
+fn eye_chunk(e: &Block) -> Chunk {
+  let eye = fov::eye_position(e);
+  Chunk::of_block(&Block::new(eye.x.round() as i32, eye.y.round() as i32, eye.z.round() as i32))
+}
+
+/// Level of detail for a chunk at its distance from the FOV vertex, given the one it was last
+/// asked to be meshed at if any.
+fn chunk_lod(chunk: &Chunk, fov: &Fov, lod: Option<u32>) -> u32 {
+  let center = chunk.xz_center();
+  let (dx, dz) = (center.x - fov.vertex.x, center.z - fov.vertex.z);
+  let distance = (dx * dx + dz * dz).sqrt();
+  match lod {
+    Some(lod) => mesh::lod_for_distance_from(lod, distance),
+    None => mesh::lod_for_distance(distance),
+  }
+}
+
 fn print_fps(fps: Stats) {
   println!("FPS: min {:.1}, avg {:.1}, max {:.1}", fps.min, fps.avg, fps.max);
 }
@@ -8,6 +8,7 @@ use collision::{Intersect, Ray2};
 use world::{Chunk, Point2, Segment2};
 
 /// Field of view.
+#[derive(Clone)]
 pub struct Fov {
   /// Vertex coordinates in the xz plane.
   pub vertex: Point2<f32>,
@@ -32,12 +33,11 @@ impl Fov {
   /// (thus the world is rotating counter-clockwise) and looking at
   /// (p.x + sin α, p.y + 2.12, p.z - cos α).
   pub fn view_matrix(&self, p: &Point3<i32>) -> Matrix4<f32> {
-    let y = p.y as f32 + 2.12;  // 0.5 for half block under feet + 1.62 up to eye height.
     let (s, c) = self.center_angle.sin_cos();
 
-    let eye = Point3::new(p.x as f32, y, p.z as f32);
+    let eye = eye_position(p);
     // Start with α == 0, looking at (p.x, y, p.z - 1).
-    let center = Point3::new(p.x as f32 + s, y, p.z as f32 - c);
+    let center = Point3::new(eye.x + s, eye.y, eye.z - c);
     let up = Vector3::new(0.0, 1.0, 0.0);
     Matrix4::look_at(eye, center, up)
   }
@@ -147,6 +147,12 @@ impl Fov {
   }
 }
 
+/// Position of the eye standing on the block at p.
+pub fn eye_position(p: &Point3<i32>) -> Point3<f32> {
+  let y = p.y as f32 + 2.12;  // 0.5 for half block under feet + 1.62 up to eye height.
+  Point3::new(p.x as f32, y, p.z as f32)
+}
+
 /// Normalizes an angle in radians into range [0; 2π).
 trait NormalizeRadians {
   fn normalize(self) -> Self;
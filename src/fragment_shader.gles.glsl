@@ -1,7 +1,19 @@
+#extension GL_EXT_shader_texture_lod : enable
+#extension GL_OES_standard_derivatives : enable
 precision mediump float;
 uniform sampler2D u_TextureUnit;
-varying vec2 v_TextureCoord;
+varying vec2 v_Tile;
+varying vec2 v_Repeat;
 
 void main() {
-  gl_FragColor = texture2D(u_TextureUnit, v_TextureCoord);
+  // Wraps the texture within its tile of the 2x2 atlas once per block.
+  vec2 wrapped = 0.5 * (v_Tile + fract(v_Repeat));
+#if defined(GL_EXT_shader_texture_lod) && defined(GL_OES_standard_derivatives)
+  // Gradients of the unwrapped coordinate keep the mipmap level from jumping at the wrap.
+  vec2 unwrapped = 0.5 * (v_Tile + v_Repeat);
+  gl_FragColor = texture2DGradEXT(u_TextureUnit, wrapped, dFdx(unwrapped), dFdy(unwrapped));
+#else
+  // The atlas has no mipmaps then, see gl::has_texture_gradients.
+  gl_FragColor = texture2D(u_TextureUnit, wrapped);
+#endif
 }
@@ -1,7 +1,12 @@
 #version 130
 uniform sampler2D u_TextureUnit;
-varying vec2 v_TextureCoord;
+varying vec2 v_Tile;
+varying vec2 v_Repeat;
 
 void main() {
-  gl_FragColor = texture2D(u_TextureUnit, v_TextureCoord);
+  // Wraps the texture within its tile of the 2x2 atlas once per block.  Gradients of the
+  // unwrapped coordinate keep the mipmap level from jumping at the wrap.
+  vec2 unwrapped = 0.5 * (v_Tile + v_Repeat);
+  gl_FragColor = textureGrad(u_TextureUnit, 0.5 * (v_Tile + fract(v_Repeat)), dFdx(unwrapped),
+    dFdy(unwrapped));
 }
@@ -0,0 +1,454 @@
+use std::f32::consts::PI;
+
+use cgmath::Matrix4;
+
+use fov::Fov;
+use world::{Chunk, Point2};
+
+/// View frustum as 6 planes (a, b, c, d), a point (x, y, z) is inside when
+/// a * x + b * y + c * z + d >= 0 for all of them.
+pub struct Frustum {
+  planes: [[f32; 4]; 6],
+}
+
+impl Frustum {
+  /// Extracts frustum planes in world coordinates from a model-view-projection matrix.
+  pub fn new(mvp: &Matrix4<f32>) -> Frustum {
+    // cgmath matrices are column major, row i is m[0][i], m[1][i], m[2][i], m[3][i].
+    let row = |i: usize| [mvp[0][i], mvp[1][i], mvp[2][i], mvp[3][i]];
+    let (r0, r1, r2, r3) = (row(0), row(1), row(2), row(3));
+    let add = |a: [f32; 4], b: [f32; 4]| [a[0] + b[0], a[1] + b[1], a[2] + b[2], a[3] + b[3]];
+    let sub = |a: [f32; 4], b: [f32; 4]| [a[0] - b[0], a[1] - b[1], a[2] - b[2], a[3] - b[3]];
+    Frustum {
+      planes: [
+        add(r3, r0),  // Left.
+        sub(r3, r0),  // Right.
+        add(r3, r1),  // Bottom.
+        sub(r3, r1),  // Top.
+        add(r3, r2),  // Near.
+        sub(r3, r2),  // Far.
+      ],
+    }
+  }
+
+  /// Whether a chunk's box intersects the frustum, may also be true for boxes just outside it like
+  /// `ChunkBounds::cull`.
+  pub fn intersects_chunk(&self, chunk: &Chunk) -> bool {
+    let bounds = chunk.block_bounds();
+    let min = [bounds.min.x as f32 - 0.5, bounds.min.y as f32 - 0.5, bounds.min.z as f32 - 0.5];
+    let max = [bounds.max.x as f32 + 0.5, bounds.max.y as f32 + 0.5, bounds.max.z as f32 + 0.5];
+    self.planes.iter().all(|p| {
+      let corner = |i: usize| if p[i] > 0.0 { max[i] } else { min[i] };
+      p[0] * corner(0) + p[1] * corner(1) + p[2] * corner(2) + p[3] >= 0.0
+    })
+  }
+}
+
+/// Columns seen wider than this from the vertex are always tested, narrower ones are only tested
+/// when their interval start is within this much before the end of the view.
+const WIDE_ANGLE: f32 = PI / 4.0;
+
+/// Bounding boxes of loaded chunk meshes, one array per coordinate so that culling runs over
+/// contiguous floats.  Entries are sorted by where their column's angular interval around the FOV
+/// vertex starts, so that for a view direction only a few contiguous runs of them need testing.
+/// A separate near to far order of entries lets culling report visible chunks front to back.
+pub struct ChunkBounds {
+  vertex: Point2<f32>,
+  chunks: Vec<Chunk>,
+  min_x: Vec<f32>,
+  min_y: Vec<f32>,
+  min_z: Vec<f32>,
+  max_x: Vec<f32>,
+  max_y: Vec<f32>,
+  max_z: Vec<f32>,
+  /// Angular interval of the chunk column around the vertex, clockwise from (0, 0, -1) like
+  /// `Fov::center_angle`, start in [0; 2π).
+  start_angle: Vec<f32>,
+  end_angle: Vec<f32>,
+  /// Squared distance from the vertex to the column center.
+  distance: Vec<f32>,
+  /// Entry indices sorted by distance.  Kept between vertex moves, it is nearly sorted after
+  /// the eye moves a block.
+  near_to_far: Vec<usize>,
+  /// Entries wider than WIDE_ANGLE.
+  wide: Vec<usize>,
+  /// Per chunk culling result and runs of entries to test, kept to avoid allocating every frame.
+  outside: Vec<bool>,
+  runs: Vec<(usize, usize)>,
+}
+
+impl ChunkBounds {
+  pub fn new(vertex: &Point2<f32>) -> ChunkBounds {
+    ChunkBounds {
+      vertex: vertex.clone(),
+      chunks: Vec::new(),
+      min_x: Vec::new(),
+      min_y: Vec::new(),
+      min_z: Vec::new(),
+      max_x: Vec::new(),
+      max_y: Vec::new(),
+      max_z: Vec::new(),
+      start_angle: Vec::new(),
+      end_angle: Vec::new(),
+      distance: Vec::new(),
+      near_to_far: Vec::new(),
+      wide: Vec::new(),
+      outside: Vec::new(),
+      runs: Vec::new(),
+    }
+  }
+
+  pub fn insert(&mut self, chunk: &Chunk) {
+    if self.chunks.contains(chunk) {
+      return;
+    }
+    // Block centers are at integer coordinates, their faces half a block out.
+    let bounds = chunk.block_bounds();
+    let (min_x, min_z) = (bounds.min.x as f32 - 0.5, bounds.min.z as f32 - 0.5);
+    let (max_x, max_z) = (bounds.max.x as f32 + 0.5, bounds.max.z as f32 + 0.5);
+    let (start, end) = column_interval(&self.vertex, min_x, min_z, max_x, max_z);
+    let i = lower_bound(&self.start_angle, start);
+    self.chunks.insert(i, chunk.clone());
+    self.min_x.insert(i, min_x);
+    self.min_y.insert(i, bounds.min.y as f32 - 0.5);
+    self.min_z.insert(i, min_z);
+    self.max_x.insert(i, max_x);
+    self.max_y.insert(i, bounds.max.y as f32 + 0.5);
+    self.max_z.insert(i, max_z);
+    self.start_angle.insert(i, start);
+    self.end_angle.insert(i, end);
+    let distance = column_distance(&self.vertex, min_x, min_z, max_x, max_z);
+    self.distance.insert(i, distance);
+    for o in self.near_to_far.iter_mut() {
+      if *o >= i {
+        *o += 1;
+      }
+    }
+    let (mut low, mut high) = (0, self.near_to_far.len());
+    while low < high {
+      let mid = (low + high) / 2;
+      if self.distance[self.near_to_far[mid]] <= distance { low = mid + 1; } else { high = mid; }
+    }
+    self.near_to_far.insert(low, i);
+    self.update_wide();
+  }
+
+  pub fn remove(&mut self, chunk: &Chunk) {
+    let i = match self.chunks.iter().position(|c| c == chunk) {
+      Some(i) => i,
+      None => return,
+    };
+    self.chunks.remove(i);
+    self.min_x.remove(i);
+    self.min_y.remove(i);
+    self.min_z.remove(i);
+    self.max_x.remove(i);
+    self.max_y.remove(i);
+    self.max_z.remove(i);
+    self.start_angle.remove(i);
+    self.end_angle.remove(i);
+    self.distance.remove(i);
+    self.near_to_far.retain(|&o| o != i);
+    for o in self.near_to_far.iter_mut() {
+      if *o > i {
+        *o -= 1;
+      }
+    }
+    self.update_wide();
+  }
+
+  /// Recomputes angular intervals and distances around a new vertex and re-sorts entries by
+  /// them.
+  pub fn set_vertex(&mut self, vertex: &Point2<f32>) {
+    if vertex.x == self.vertex.x && vertex.z == self.vertex.z {
+      return;
+    }
+    self.vertex = vertex.clone();
+    for i in 0..self.chunks.len() {
+      let (start, end) = column_interval(vertex, self.min_x[i], self.min_z[i], self.max_x[i],
+        self.max_z[i]);
+      self.start_angle[i] = start;
+      self.end_angle[i] = end;
+      self.distance[i] = column_distance(vertex, self.min_x[i], self.min_z[i], self.max_x[i],
+        self.max_z[i]);
+    }
+    let mut order: Vec<usize> = (0..self.chunks.len()).collect();
+    order.sort_by(|&a, &b| self.start_angle[a].partial_cmp(&self.start_angle[b]).unwrap());
+    self.chunks = order.iter().map(|&i| self.chunks[i].clone()).collect();
+    for v in [&mut self.min_x, &mut self.min_y, &mut self.min_z, &mut self.max_x, &mut self.max_y,
+        &mut self.max_z, &mut self.start_angle, &mut self.end_angle, &mut self.distance]
+        .iter_mut() {
+      let sorted: Vec<f32> = order.iter().map(|&i| v[i]).collect();
+      **v = sorted;
+    }
+
+    // Move the previous near to far order over to the new entry indices, then insertion sort it,
+    // which is about linear since a step of the eye changes few distances' order.
+    let mut new_index = vec![0; order.len()];
+    for (new, &old) in order.iter().enumerate() {
+      new_index[old] = new;
+    }
+    for o in self.near_to_far.iter_mut() {
+      *o = new_index[*o];
+    }
+    for i in 1..self.near_to_far.len() {
+      let mut j = i;
+      while j > 0 && self.distance[self.near_to_far[j - 1]] > self.distance[self.near_to_far[j]] {
+        self.near_to_far.swap(j - 1, j);
+        j -= 1;
+      }
+    }
+    self.update_wide();
+  }
+
+  #[allow(dead_code)]
+  pub fn len(&self) -> usize {
+    self.chunks.len()
+  }
+
+  /// Replaces the contents of visible with chunks whose boxes intersect the frustum, nearest
+  /// first so that depth testing rejects the fragments of chunks behind them.  Boxes
+  /// outside the frustum but crossing the corner of two planes may be reported visible.  Only
+  /// chunks whose columns are within the FOV's angular interval around the vertex get tested, which
+  /// assumes the camera is at the vertex and only turns around the vertical axis.
+  pub fn cull(&mut self, frustum: &Frustum, fov: &Fov, visible: &mut Vec<Chunk>) {
+    let n = self.chunks.len();
+    self.outside.clear();
+    self.outside.resize(n, true);
+
+    // Runs of entries whose interval may overlap the view, with the view shifted by a full turn
+    // either way to catch intervals wrapping around 2π.
+    self.runs.clear();
+    let view_start = normalize_angle(fov.center_angle - fov.view_angle / 2.0);
+    for turn in [-2.0 * PI, 0.0, 2.0 * PI].iter() {
+      let (from, to) = (view_start + turn, view_start + turn + fov.view_angle);
+      let first = lower_bound(&self.start_angle, from - WIDE_ANGLE);
+      let last = upper_bound(&self.start_angle, to);
+      if first < last {
+        self.runs.push((first, last));
+      }
+    }
+    for &i in self.wide.iter() {
+      self.runs.push((i, i + 1));
+    }
+
+    for &(first, last) in self.runs.iter() {
+      for i in first..last {
+        self.outside[i] = false;
+      }
+    }
+    for p in frustum.planes.iter() {
+      // The box corner furthest along the plane normal decides, pick its coordinate arrays once
+      // per plane.
+      let xs = if p[0] > 0.0 { &self.max_x } else { &self.min_x };
+      let ys = if p[1] > 0.0 { &self.max_y } else { &self.min_y };
+      let zs = if p[2] > 0.0 { &self.max_z } else { &self.min_z };
+      for &(first, last) in self.runs.iter() {
+        let outside = &mut self.outside[first..last];
+        let (xs, ys, zs) = (&xs[first..last], &ys[first..last], &zs[first..last]);
+        for i in 0..outside.len() {
+          outside[i] |= p[0] * xs[i] + p[1] * ys[i] + p[2] * zs[i] + p[3] < 0.0;
+        }
+      }
+    }
+
+    visible.clear();
+    for &i in self.near_to_far.iter() {
+      if !self.outside[i] {
+        visible.push(self.chunks[i].clone());
+      }
+    }
+  }
+
+  fn update_wide(&mut self) {
+    self.wide.clear();
+    for i in 0..self.chunks.len() {
+      if self.end_angle[i] - self.start_angle[i] > WIDE_ANGLE {
+        self.wide.push(i);
+      }
+    }
+  }
+}
+
+/// Angle in [0; 2π).
+fn normalize_angle(angle: f32) -> f32 {
+  let a = angle % (2.0 * PI);
+  if a < 0.0 { a + 2.0 * PI } else { a }
+}
+
+/// Angle of the direction (dx, dz), clockwise from (0, 0, -1).
+fn yaw(dx: f32, dz: f32) -> f32 {
+  normalize_angle(dx.atan2(-dz))
+}
+
+/// Smallest angular interval (start, end) covering a column's xz rectangle seen from vertex,
+/// start in [0; 2π).  Full turn if the vertex is inside.
+fn column_interval(vertex: &Point2<f32>, min_x: f32, min_z: f32, max_x: f32, max_z: f32)
+    -> (f32, f32) {
+  if vertex.x >= min_x && vertex.x <= max_x && vertex.z >= min_z && vertex.z <= max_z {
+    return (0.0, 2.0 * PI);
+  }
+  // The rectangle covers less than half a turn, measure corners relative to one of them.
+  let first = yaw(min_x - vertex.x, min_z - vertex.z);
+  let (mut low, mut high) = (0.0f32, 0.0f32);
+  for &(x, z) in [(max_x, min_z), (min_x, max_z), (max_x, max_z)].iter() {
+    let mut relative = yaw(x - vertex.x, z - vertex.z) - first;
+    if relative > PI {
+      relative -= 2.0 * PI;
+    } else if relative < -PI {
+      relative += 2.0 * PI;
+    }
+    low = low.min(relative);
+    high = high.max(relative);
+  }
+  let start = normalize_angle(first + low);
+  (start, start + high - low)
+}
+
+/// Squared distance from vertex to the center of a column's xz rectangle.
+fn column_distance(vertex: &Point2<f32>, min_x: f32, min_z: f32, max_x: f32, max_z: f32) -> f32 {
+  let dx = 0.5 * (min_x + max_x) - vertex.x;
+  let dz = 0.5 * (min_z + max_z) - vertex.z;
+  dx * dx + dz * dz
+}
+
+/// Index of the first value >= x in sorted values.
+fn lower_bound(values: &[f32], x: f32) -> usize {
+  let (mut low, mut high) = (0, values.len());
+  while low < high {
+    let mid = (low + high) / 2;
+    if values[mid] < x { low = mid + 1; } else { high = mid; }
+  }
+  low
+}
+
+/// Index of the first value > x in sorted values.
+fn upper_bound(values: &[f32], x: f32) -> usize {
+  let (mut low, mut high) = (0, values.len());
+  while low < high {
+    let mid = (low + high) / 2;
+    if values[mid] <= x { low = mid + 1; } else { high = mid; }
+  }
+  low
+}
+
+#[cfg(test)]
+mod tests {
+  use std::collections::HashSet;
+  use std::f32::consts::PI;
+  use cgmath::Point3;
+  use fov::Fov;
+  use world::{Chunk, Point2};
+  use super::{ChunkBounds, Frustum, column_interval};
+
+  fn fov(center_angle: f32) -> Fov {
+    Fov {
+      vertex: Point2::new(0.0, 0.0),
+      center_angle: center_angle,
+      view_angle: PI / 2.0,
+    }
+  }
+
+  fn frustum(center_angle: f32) -> Frustum {
+    let fov = fov(center_angle);
+    Frustum::new(&(fov.projection_matrix(800, 600) * fov.view_matrix(&Point3::new(0, 0, 0))))
+  }
+
+  fn visible(bounds: &mut ChunkBounds, center_angle: f32) -> Vec<Chunk> {
+    let mut visible = Vec::new();
+    bounds.cull(&frustum(center_angle), &fov(center_angle), &mut visible);
+    visible
+  }
+
+  #[test]
+  fn culls_behind_beside_and_beyond_far_plane() {
+    let mut bounds = ChunkBounds::new(&Point2::new(0.0, 0.0));
+    let ahead = Chunk::new(0, 0, -1);
+    let behind = Chunk::new(0, 0, 2);
+    let beside = Chunk::new(3, 0, 0);
+    let too_far = Chunk::new(0, 0, -5);
+    let above = Chunk::new(0, 3, -1);
+    for c in [&ahead, &behind, &beside, &too_far, &above].iter() {
+      bounds.insert(c);
+    }
+    assert_eq!(vec![ahead.clone()], visible(&mut bounds, 0.0));
+    // Turned around, only the chunk behind gets into view.
+    assert_eq!(vec![behind], visible(&mut bounds, PI));
+  }
+
+  #[test]
+  fn remove_keeps_remaining_chunks() {
+    let mut bounds = ChunkBounds::new(&Point2::new(0.0, 0.0));
+    let chunks = [Chunk::new(0, 0, -1), Chunk::new(1, 0, -2), Chunk::new(-1, 0, -2)];
+    for c in chunks.iter() {
+      bounds.insert(c);
+    }
+    bounds.remove(&chunks[0]);
+    bounds.remove(&chunks[0]);
+    assert_eq!(2, bounds.len());
+    let v: HashSet<Chunk> = visible(&mut bounds, 0.0).into_iter().collect();
+    let expected: HashSet<Chunk> = chunks[1..].iter().cloned().collect();
+    assert_eq!(expected, v);
+  }
+
+  #[test]
+  fn column_interval_wraps_around_north() {
+    let vertex = Point2::new(0.0, 0.0);
+    // Straight ahead, half a turn to either side of -z.
+    let (start, end) = column_interval(&vertex, -1.0, -11.0, 1.0, -9.0);
+    assert!(start > 1.5 * PI && end > 2.0 * PI && end - start < 0.25);
+    // To the right, around +x.
+    let (start, end) = column_interval(&vertex, 9.0, -1.0, 11.0, 1.0);
+    assert!(start < PI / 2.0 && end > PI / 2.0 && end - start < 0.25);
+    assert_eq!((0.0, 2.0 * PI), column_interval(&vertex, -1.0, -1.0, 1.0, 1.0));
+  }
+
+  #[test]
+  fn angular_index_matches_full_cull() {
+    // A ring of columns around the vertex, culled with the index for every view direction,
+    // matches what the frustum planes alone let through.
+    let mut bounds = ChunkBounds::new(&Point2::new(0.0, 0.0));
+    for x in -3..4 {
+      for z in -3..4 {
+        bounds.insert(&Chunk::new(x, 0, z));
+      }
+    }
+    bounds.set_vertex(&Point2::new(3.0, -5.0));
+    for i in 0..72 {
+      let angle = i as f32 * PI / 36.0;
+      let mut fov = fov(angle);
+      fov.vertex = Point2::new(3.0, -5.0);
+      let frustum = Frustum::new(&(fov.projection_matrix(800, 600) *
+        fov.view_matrix(&Point3::new(3, 0, -5))));
+      let mut indexed = Vec::new();
+      bounds.cull(&frustum, &fov, &mut indexed);
+      let everything = Fov { view_angle: 2.0 * PI, ..fov.clone() };
+      let mut full = Vec::new();
+      bounds.cull(&frustum, &everything, &mut full);
+      let indexed: HashSet<Chunk> = indexed.into_iter().collect();
+      let full: HashSet<Chunk> = full.into_iter().collect();
+      assert_eq!(full, indexed, "center angle {}", angle);
+    }
+  }
+
+  #[test]
+  fn visible_chunks_near_to_far() {
+    let mut bounds = ChunkBounds::new(&Point2::new(0.0, 0.0));
+    for z in [-3, -1, -2, 0].iter() {
+      bounds.insert(&Chunk::new(0, 0, *z));
+    }
+    let near_to_far: Vec<Chunk> = [0, -1, -2, -3].iter().map(|z| Chunk::new(0, 0, *z)).collect();
+    assert_eq!(near_to_far, visible(&mut bounds, 0.0));
+    // Walked past them and turned around.
+    bounds.set_vertex(&Point2::new(0.0, -60.0));
+    bounds.remove(&Chunk::new(0, 0, -2));
+    let mut fov = fov(PI);
+    fov.vertex = Point2::new(0.0, -60.0);
+    let frustum = Frustum::new(&(fov.projection_matrix(800, 600) *
+      fov.view_matrix(&Point3::new(0, 0, -60))));
+    let mut visible = Vec::new();
+    bounds.cull(&frustum, &fov, &mut visible);
+    let near_to_far = vec![Chunk::new(0, 0, -3), Chunk::new(0, 0, -1), Chunk::new(0, 0, 0)];
+    assert_eq!(near_to_far, visible);
+  }
+}
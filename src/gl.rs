@@ -3,11 +3,16 @@ extern crate libc;
 
 use libc::{c_char, c_float, c_int, c_uchar, c_uint, c_void, ptrdiff_t, uint8_t};
 use std::ffi::{CStr, CString};
+use std::mem;
 use std::ptr;
 use std::str;
 
 use cgmath::Matrix4;
+#[cfg(target_os = "android")]
+use egl;
 use mesh::Coords;
+#[cfg(target_os = "linux")]
+use x11;
 
 pub type Enum = c_uint;
 
@@ -18,7 +23,6 @@ pub const VENDOR: Enum = 0x1F00;
 pub const RENDERER: Enum = 0x1F01;
 #[allow(dead_code)]
 pub const VERSION: Enum = 0x1F02;
-#[allow(dead_code)]
 pub const EXTENSIONS: Enum = 0x1F03;
 #[allow(dead_code)]
 pub const SHADING_LANGUAGE_VERSION: Enum = 0x8B8C;
@@ -61,6 +65,7 @@ type Float = c_float;
 pub type Int = c_int;
 type SizeI = c_int;
 type SizeIPtr = ptrdiff_t;
+type IntPtr = ptrdiff_t;
 type UByte = uint8_t;
 pub type UInt = c_uint;
 type Void = c_void;
@@ -82,7 +87,6 @@ pub enum Error {
   OutOfMemory,
 }
 
-#[allow(dead_code)]
 pub fn get_string(name: Enum) -> Result<String, Error> {
   unsafe {
     let c_str = glGetString(name) as *const c_char;
@@ -127,6 +131,20 @@ pub fn clear(mask: Bitfield) {
   }
 }
 
+/// Turns writing all color channels on or off.
+pub fn color_mask(write: bool) {
+  let flag = (if write { TRUE } else { FALSE }) as Boolean;
+  unsafe {
+    glColorMask(flag, flag, flag, flag);
+  }
+}
+
+pub fn depth_mask(write: bool) {
+  unsafe {
+    glDepthMask((if write { TRUE } else { FALSE }) as Boolean);
+  }
+}
+
 // Depth functions:
 pub const LEQUAL: Enum = 0x0203;
 
@@ -365,6 +383,12 @@ pub fn uniform_matrix4_f32(location: UnifLoc, matrix: &Matrix4<f32>) {
   }
 }
 
+pub fn uniform_vec3_f32(location: UnifLoc, value: &[f32; 3]) {
+  unsafe {
+    glUniform3f(location, value[0], value[1], value[2]);
+  }
+}
+
 pub fn uniform_int(location: UnifLoc, value: Int) {
   unsafe {
     glUniform1i(location, value);
@@ -374,7 +398,6 @@ pub fn uniform_int(location: UnifLoc, value: Int) {
 // Data types:
 #[allow(dead_code)]
 const BYTE: Enum = 0x1400;
-#[allow(dead_code)]
 const UNSIGNED_BYTE: Enum = 0x1401;
 #[allow(dead_code)]
 const SHORT: Enum = 0x1402;
@@ -383,19 +406,22 @@ const UNSIGNED_SHORT: Enum = 0x1403;
 const INT: Enum = 0x1404;
 #[allow(dead_code)]
 const UNSIGNED_INT: Enum = 0x1405;
+#[allow(dead_code)]
 const FLOAT: Enum = 0x1406;
 #[allow(dead_code)]
 const FIXED: Enum = 0x140C;
 
+#[allow(dead_code)]
 pub fn vertex_attrib_pointer_f32(location: AttribLoc, components: i32, stride: i32, offset: u32) {
   unsafe {
     glVertexAttribPointer(location as u32, components, FLOAT, FALSE as u8, stride, offset as *const Void);
   }
 }
 
-pub fn vertex_attrib_pointer_u16(location: AttribLoc, components: i32, stride: i32, offset: u32) {
+/// Not normalized, shaders see the integer values.
+pub fn vertex_attrib_pointer_u8(location: AttribLoc, components: i32, stride: i32, offset: u32) {
   unsafe {
-    glVertexAttribPointer(location as u32, components, UNSIGNED_SHORT, TRUE as u8, stride, offset as *const Void);
+    glVertexAttribPointer(location as u32, components, UNSIGNED_BYTE, FALSE as u8, stride, offset as *const Void);
   }
 }
 
@@ -414,9 +440,10 @@ pub fn disable_vertex_attrib_array(location: AttribLoc) {
 // glDrawElements modes:
 const TRIANGLES: Enum = 0x0004;
 
-pub fn draw_elements_triangles_u16(count: i32) {
+/// Draws count indices of the bound index buffer, starting with index first.
+pub fn draw_elements_triangles_u16(first: u32, count: i32) {
   unsafe {
-    glDrawElements(TRIANGLES, count, UNSIGNED_SHORT, ptr::null());
+    glDrawElements(TRIANGLES, count, UNSIGNED_SHORT, (2 * first as usize) as *const c_void);
   }
 }
 
@@ -546,8 +573,24 @@ pub fn array_buffer_data_coords(data: &[Coords]) {
   }
 }
 
+/// Allocates uninitialized storage for the bound array buffer, to be filled in parts.
+pub fn array_buffer_reserve(size_in_bytes: u32) {
+  unsafe {
+    glBufferData(ARRAY_BUFFER, size_in_bytes as SizeIPtr, ptr::null(), DYNAMIC_DRAW);
+  }
+}
+
+pub fn array_buffer_sub_data_coords(offset_in_bytes: u32, data: &[Coords]) {
+  let size_in_bytes = data.len() as SizeIPtr * Coords::size_bytes() as SizeIPtr;
+  unsafe {
+    glBufferSubData(ARRAY_BUFFER, offset_in_bytes as IntPtr, size_in_bytes,
+      data.as_ptr() as *const Void);
+  }
+}
+
 // Usage types:
 const STATIC_DRAW: Enum = 0x88E4;
+const DYNAMIC_DRAW: Enum = 0x88E8;
 
 pub fn index_buffer_data_u16(data: &[u16]) {
   let size_in_bytes = data.len() as SizeIPtr * 2;
@@ -556,6 +599,217 @@ pub fn index_buffer_data_u16(data: &[u16]) {
   }
 }
 
+// Vertex array objects come from an extension on both GLES2 and GL 1.4, so they are loaded at
+// runtime when the extension is there.
+#[cfg(target_os = "android")]
+const VERTEX_ARRAY_EXTENSION: &'static str = "GL_OES_vertex_array_object";
+#[cfg(target_os = "android")]
+const VERTEX_ARRAY_FUNCTIONS: [&'static str; 3] =
+  ["glGenVertexArraysOES", "glBindVertexArrayOES", "glDeleteVertexArraysOES"];
+#[cfg(target_os = "linux")]
+const VERTEX_ARRAY_EXTENSION: &'static str = "GL_ARB_vertex_array_object";
+#[cfg(target_os = "linux")]
+const VERTEX_ARRAY_FUNCTIONS: [&'static str; 3] =
+  ["glGenVertexArrays", "glBindVertexArray", "glDeleteVertexArrays"];
+
+type GenVertexArraysFn = extern "system" fn(count: SizeI, arrays: *mut UInt);
+type BindVertexArrayFn = extern "system" fn(array: UInt);
+type DeleteVertexArraysFn = extern "system" fn(count: SizeI, arrays: *const UInt);
+
+/// Whether fragment shaders can sample with explicit gradients.  Greedy meshes wrap texture
+/// coordinates within each quad, without gradients the mipmap level jumps at every wrap.
+#[cfg(target_os = "android")]
+pub fn has_texture_gradients() -> bool {
+  has_extension("GL_EXT_shader_texture_lod") && has_extension("GL_OES_standard_derivatives")
+}
+
+/// Whether fragment shaders can sample with explicit gradients, GLSL 1.30 has `textureGrad`.
+#[cfg(target_os = "linux")]
+pub fn has_texture_gradients() -> bool {
+  true
+}
+
+/// Whether the current context lists an extension.
+fn has_extension(name: &str) -> bool {
+  match get_string(EXTENSIONS) {
+    Ok(extensions) => extensions.split(' ').any(|e| e == name),
+    Err(_) => false,
+  }
+}
+
+/// Address of an optional extension function, null if it is missing.
+#[cfg(target_os = "android")]
+fn get_proc_address(proc_name: &str) -> *const Void {
+  egl::get_proc_address(proc_name)
+}
+
+/// Address of an optional extension function, null if it is missing.
+#[cfg(target_os = "linux")]
+fn get_proc_address(proc_name: &str) -> *const Void {
+  match x11::try_get_proc_address(proc_name) {
+    Some(p) => p as *const Void,
+    None => ptr::null(),
+  }
+}
+
+/// Vertex array object functions.
+#[derive(Clone, Copy)]
+pub struct VertexArrayFns {
+  gen: GenVertexArraysFn,
+  bind: BindVertexArrayFn,
+  delete: DeleteVertexArraysFn,
+}
+
+impl VertexArrayFns {
+  /// Loads vertex array object functions if the current context supports them.
+  pub fn load() -> Option<VertexArrayFns> {
+    if !has_extension(VERTEX_ARRAY_EXTENSION) {
+      return None;
+    }
+    let addresses: Vec<*const Void> =
+      VERTEX_ARRAY_FUNCTIONS.iter().map(|name| get_proc_address(name)).collect();
+    if addresses.iter().any(|a| a.is_null()) {
+      return None;
+    }
+    unsafe {
+      Some(VertexArrayFns {
+        gen: mem::transmute::<_, GenVertexArraysFn>(addresses[0]),
+        bind: mem::transmute::<_, BindVertexArrayFn>(addresses[1]),
+        delete: mem::transmute::<_, DeleteVertexArraysFn>(addresses[2]),
+      })
+    }
+  }
+
+  /// Goes back to the default vertex array state.
+  pub fn unbind(&self) {
+    (self.bind)(0);
+  }
+}
+
+/// A vertex array object, deleted on drop.
+pub struct VertexArrayObject {
+  id: UInt,
+  fns: VertexArrayFns,
+}
+
+impl VertexArrayObject {
+  pub fn new(fns: &VertexArrayFns) -> VertexArrayObject {
+    let mut id = 0;
+    (fns.gen)(1, &mut id);
+    VertexArrayObject {
+      id: id,
+      fns: *fns,
+    }
+  }
+
+  pub fn bind(&self) {
+    (self.fns.bind)(self.id);
+  }
+
+  pub fn unbind(&self) {
+    self.fns.unbind();
+  }
+}
+
+impl Drop for VertexArrayObject {
+  fn drop(&mut self) {
+    (self.fns.delete)(1, &self.id);
+  }
+}
+
+// Occlusion queries are an extension too: a boolean any samples passed query on GLES2, a sample
+// count on GL 1.4.  Either is only compared with 0.
+#[cfg(target_os = "android")]
+const QUERY_EXTENSION: &'static str = "GL_EXT_occlusion_query_boolean";
+#[cfg(target_os = "android")]
+const QUERY_FUNCTIONS: [&'static str; 5] = ["glGenQueriesEXT", "glDeleteQueriesEXT",
+  "glBeginQueryEXT", "glEndQueryEXT", "glGetQueryObjectuivEXT"];
+#[cfg(target_os = "android")]
+const QUERY_TARGET: Enum = 0x8C2F;  // GL_ANY_SAMPLES_PASSED_EXT
+#[cfg(target_os = "linux")]
+const QUERY_EXTENSION: &'static str = "GL_ARB_occlusion_query";
+#[cfg(target_os = "linux")]
+const QUERY_FUNCTIONS: [&'static str; 5] = ["glGenQueriesARB", "glDeleteQueriesARB",
+  "glBeginQueryARB", "glEndQueryARB", "glGetQueryObjectuivARB"];
+#[cfg(target_os = "linux")]
+const QUERY_TARGET: Enum = 0x8914;  // GL_SAMPLES_PASSED_ARB
+const QUERY_RESULT: Enum = 0x8866;
+const QUERY_RESULT_AVAILABLE: Enum = 0x8867;
+
+type GenQueriesFn = extern "system" fn(count: SizeI, ids: *mut UInt);
+type DeleteQueriesFn = extern "system" fn(count: SizeI, ids: *const UInt);
+type BeginQueryFn = extern "system" fn(target: Enum, id: UInt);
+type EndQueryFn = extern "system" fn(target: Enum);
+type GetQueryObjectUIntFn = extern "system" fn(id: UInt, param_name: Enum, out_params: *mut UInt);
+
+pub type Query = UInt;
+
+/// Occlusion query functions.
+#[derive(Clone, Copy)]
+pub struct QueryFns {
+  gen: GenQueriesFn,
+  delete: DeleteQueriesFn,
+  begin: BeginQueryFn,
+  end: EndQueryFn,
+  get_object_uint: GetQueryObjectUIntFn,
+}
+
+impl QueryFns {
+  /// Loads occlusion query functions if the current context supports them.
+  pub fn load() -> Option<QueryFns> {
+    if !has_extension(QUERY_EXTENSION) {
+      return None;
+    }
+    let addresses: Vec<*const Void> =
+      QUERY_FUNCTIONS.iter().map(|name| get_proc_address(name)).collect();
+    if addresses.iter().any(|a| a.is_null()) {
+      return None;
+    }
+    unsafe {
+      Some(QueryFns {
+        gen: mem::transmute::<_, GenQueriesFn>(addresses[0]),
+        delete: mem::transmute::<_, DeleteQueriesFn>(addresses[1]),
+        begin: mem::transmute::<_, BeginQueryFn>(addresses[2]),
+        end: mem::transmute::<_, EndQueryFn>(addresses[3]),
+        get_object_uint: mem::transmute::<_, GetQueryObjectUIntFn>(addresses[4]),
+      })
+    }
+  }
+
+  pub fn generate(&self) -> Query {
+    let mut id = 0;
+    (self.gen)(1, &mut id);
+    id
+  }
+
+  pub fn delete(&self, queries: &[Query]) {
+    (self.delete)(queries.len() as SizeI, queries.as_ptr());
+  }
+
+  /// Starts counting samples passing the depth test.
+  pub fn begin(&self, query: Query) {
+    (self.begin)(QUERY_TARGET, query);
+  }
+
+  pub fn end(&self) {
+    (self.end)(QUERY_TARGET);
+  }
+
+  /// Whether the result of an ended query can be read without waiting for the GPU.
+  pub fn result_available(&self, query: Query) -> bool {
+    let mut available = 0;
+    (self.get_object_uint)(query, QUERY_RESULT_AVAILABLE, &mut available);
+    available != 0
+  }
+
+  /// Whether any samples passed, waits for the GPU unless `result_available`.
+  pub fn any_samples_passed(&self, query: Query) -> bool {
+    let mut result = 0;
+    (self.get_object_uint)(query, QUERY_RESULT, &mut result);
+    result != 0
+  }
+}
+
 #[cfg(target_os = "android")]
 #[link(name = "GLESv2")]
 extern "C" {
@@ -566,6 +820,8 @@ extern "C" {
   fn glClearColor(red: Clampf, green: Clampf, blue: Clampf, alpha: Clampf);
   fn glClear(mask: Bitfield);
   fn glDepthFunc(func: Enum);
+  fn glColorMask(red: Boolean, green: Boolean, blue: Boolean, alpha: Boolean);
+  fn glDepthMask(flag: Boolean);
   fn glCreateShader(shader_type: Enum) -> UInt;
   fn glShaderSource(shader: UInt, count: SizeI, strings: *const *const Char, lengths: *const Int);
   fn glCompileShader(shader: UInt);
@@ -586,6 +842,7 @@ extern "C" {
   fn glViewport(x: Int, y: Int, width: SizeI, height: SizeI);
   fn glUniformMatrix4fv(location: Int, count: SizeI, transpose: Boolean, value: *const Float);
   fn glUniform1i(location: Int, value: Int);
+  fn glUniform3f(location: Int, v0: Float, v1: Float, v2: Float);
   fn glVertexAttribPointer(index: UInt, size: Int, data_type: Enum, normalized: Boolean, stride: SizeI, pointer: *const Void);
   fn glEnableVertexAttribArray(index: UInt);
   fn glDisableVertexAttribArray(index: UInt);
@@ -599,6 +856,7 @@ extern "C" {
   fn glGenBuffers(count: SizeI, buffers: *mut UInt);
   fn glBindBuffer(target: Enum, buffer: UInt);
   fn glBufferData(target: Enum, size: SizeIPtr, data: *const c_void, usage: Enum);
+  fn glBufferSubData(target: Enum, offset: IntPtr, size: SizeIPtr, data: *const c_void);
   fn glDeleteBuffers(count: SizeI, buffers: *const UInt);
 }
 
@@ -612,6 +870,8 @@ extern "C" {
   fn glClearColor(red: Clampf, green: Clampf, blue: Clampf, alpha: Clampf);
   fn glClear(mask: Bitfield);
   fn glDepthFunc(func: Enum);
+  fn glColorMask(red: Boolean, green: Boolean, blue: Boolean, alpha: Boolean);
+  fn glDepthMask(flag: Boolean);
   fn glCreateShader(shader_type: Enum) -> UInt;
   fn glShaderSource(shader: UInt, count: SizeI, strings: *const *const Char, lengths: *const Int);
   fn glCompileShader(shader: UInt);
@@ -632,6 +892,7 @@ extern "C" {
   fn glViewport(x: Int, y: Int, width: SizeI, height: SizeI);
   fn glUniformMatrix4fv(location: Int, count: SizeI, transpose: Boolean, value: *const Float);
   fn glUniform1i(location: Int, value: Int);
+  fn glUniform3f(location: Int, v0: Float, v1: Float, v2: Float);
   fn glVertexAttribPointer(index: UInt, size: Int, data_type: Enum, normalized: Boolean, stride: SizeI, pointer: *const Void);
   fn glEnableVertexAttribArray(index: UInt);
   fn glDisableVertexAttribArray(index: UInt);
@@ -645,5 +906,6 @@ extern "C" {
   fn glGenBuffers(count: SizeI, buffers: *mut UInt);
   fn glBindBuffer(target: Enum, buffer: UInt);
   fn glBufferData(target: Enum, size: SizeIPtr, data: *const c_void, usage: Enum);
+  fn glBufferSubData(target: Enum, offset: IntPtr, size: SizeIPtr, data: *const c_void);
   fn glDeleteBuffers(count: SizeI, buffers: *const UInt);
 }
@@ -0,0 +1,206 @@
+use std::collections::VecDeque;
+use std::sync::{Arc, Condvar, Mutex};
+use std::sync::mpsc::{Receiver, SyncSender, TryRecvError, sync_channel};
+use std::thread;
+
+use fov::Fov;
+use mesh;
+use mesh::{MeshScratch, Vertices};
+use perlin;
+use scheduler::Scheduler;
+use world::{Chunk, ChunkBlocks, Neighborhood};
+
+/// Number of background threads generating and meshing chunks.
+const WORKER_COUNT: usize = 2;
+
+/// Capacity of the channel for finished work.  Workers block when the render thread falls behind.
+const RESULT_CAPACITY: usize = 16;
+
+enum Job {
+  Generate(Chunk),
+  /// Neighborhood, level of detail and job number.
+  Mesh(Neighborhood, u32, u32),
+  /// Neighborhood, the sides to remesh, a bit per face direction, and job number.
+  MeshSides(Neighborhood, u32, u32),
+}
+
+/// Work finished by a background thread.  Meshes carry the number of the job they came from.
+pub enum Loaded {
+  Generated(Chunk, Arc<ChunkBlocks>),
+  Meshed(Chunk, u32, Vertices),
+  /// Sides remeshed, a bit per face direction, see `Vertices::with_sides`.
+  SidesMeshed(Chunk, u32, u32, Vertices),
+}
+
+struct Queue {
+  state: Mutex<QueueState>,
+  available: Condvar,
+}
+
+struct QueueState {
+  /// Meshing jobs, they finish already generated chunks so always go first.
+  meshes: VecDeque<Job>,
+  /// Chunks to generate, in order of what the camera sees.
+  chunks: Scheduler,
+  /// Number of the next meshing job.
+  next_job: u32,
+  shutdown: bool,
+}
+
+/// Pool of background threads running chunk generation and meshing off the render thread.
+pub struct Loader {
+  queue: Arc<Queue>,
+  results: Receiver<Loaded>,
+}
+
+impl Drop for Loader {
+  fn drop(&mut self) {
+    // Workers exit before picking up the next job.  The ones blocked on a full result channel
+    // fail to send and exit as soon as the receiver is gone.
+    self.queue.state.lock().unwrap().shutdown = true;
+    self.queue.available.notify_all();
+  }
+}
+
+impl Loader {
+  pub fn new(view: &Fov) -> Loader {
+    let queue = Arc::new(Queue {
+      state: Mutex::new(QueueState {
+        meshes: VecDeque::new(),
+        chunks: Scheduler::new(view),
+        next_job: 0,
+        shutdown: false,
+      }),
+      available: Condvar::new(),
+    });
+    let (tx, rx) = sync_channel(RESULT_CAPACITY);
+    for i in 0..WORKER_COUNT {
+      let queue = queue.clone();
+      let tx = tx.clone();
+      let spawned = thread::Builder::new()
+        .name(format!("loader-{}", i))
+        .spawn(move || work(&queue, &tx));
+      if let Err(e) = spawned {
+        panic!("Failed to start loader thread: {}", e);
+      }
+    }
+    Loader {
+      queue: queue,
+      results: rx,
+    }
+  }
+
+  /// Queues generating blocks for a chunk.
+  pub fn generate(&self, chunk: Chunk) {
+    let mut state = self.queue.state.lock().unwrap();
+    state.chunks.push(chunk);
+    self.queue.available.notify_one();
+  }
+
+  /// Queues meshing a generated chunk at a level of detail, returns the job number its result
+  /// will carry.  Goes ahead of generation since it finishes a chunk which is already half way
+  /// done.
+  pub fn mesh(&self, neighborhood: Neighborhood, lod: u32) -> u32 {
+    let mut state = self.queue.state.lock().unwrap();
+    let job = state.take_job_number();
+    state.meshes.push_back(Job::Mesh(neighborhood, lod, job));
+    self.queue.available.notify_one();
+    job
+  }
+
+  /// Queues remeshing the sides of a full detail chunk mesh after neighbors on these sides
+  /// changed, sides given as a bit per face direction.  Returns the job number its result will
+  /// carry.
+  pub fn mesh_sides(&self, neighborhood: Neighborhood, sides: u32) -> u32 {
+    let mut state = self.queue.state.lock().unwrap();
+    let job = state.take_job_number();
+    state.meshes.push_back(Job::MeshSides(neighborhood, sides, job));
+    self.queue.available.notify_one();
+    job
+  }
+
+  /// Drops queued jobs for a chunk which is no longer needed.  Jobs already running still finish.
+  pub fn cancel(&self, chunk: &Chunk) {
+    self.cancel_meshing(chunk);
+    self.queue.state.lock().unwrap().chunks.cancel(chunk);
+  }
+
+  /// Drops queued meshing jobs for a chunk, true if there were any.  Jobs already running still
+  /// finish.
+  pub fn cancel_meshing(&self, chunk: &Chunk) -> bool {
+    let mut state = self.queue.state.lock().unwrap();
+    let queued = state.meshes.len();
+    state.meshes.retain(|job| match *job {
+      Job::Mesh(ref n, _, _) | Job::MeshSides(ref n, _, _) => n.chunk != *chunk,
+      Job::Generate(_) => true,
+    });
+    state.meshes.len() < queued
+  }
+
+  /// Drops all queued meshing jobs.  Jobs already running still finish.
+  #[cfg(target_os = "android")]
+  pub fn cancel_all_meshing(&self) {
+    self.queue.state.lock().unwrap().meshes.clear();
+  }
+
+  /// Updates the view used to prioritize chunk generation.
+  pub fn set_view(&self, view: &Fov) {
+    self.queue.state.lock().unwrap().chunks.set_view(view);
+  }
+
+  /// Returns the next piece of finished work if there is any, does not block.
+  pub fn try_recv(&self) -> Option<Loaded> {
+    match self.results.try_recv() {
+      Ok(loaded) => Some(loaded),
+      Err(TryRecvError::Empty) => None,
+      Err(TryRecvError::Disconnected) => panic!("All loader threads died"),
+    }
+  }
+}
+
+impl QueueState {
+  fn take_job_number(&mut self) -> u32 {
+    let job = self.next_job;
+    self.next_job = job.wrapping_add(1);
+    job
+  }
+}
+
+/// Blocks until a job is available.  Returns `None` on shutdown.
+fn next_job(queue: &Queue) -> Option<Job> {
+  let mut state = queue.state.lock().unwrap();
+  while !state.shutdown {
+    if let Some(job) = state.meshes.pop_front() {
+      return Some(job);
+    }
+    if let Some(chunk) = state.chunks.pop() {
+      return Some(Job::Generate(chunk));
+    }
+    state = queue.available.wait(state).unwrap();
+  }
+  None
+}
+
+fn work(queue: &Queue, results: &SyncSender<Loaded>) {
+  let mut scratch = MeshScratch::new();
+  while let Some(job) = next_job(queue) {
+    let loaded = match job {
+      Job::Generate(chunk) => {
+        let blocks = perlin::generate_blocks(&chunk.block_bounds());
+        Loaded::Generated(chunk, Arc::new(blocks))
+      },
+      Job::Mesh(neighborhood, lod, job) => {
+        let vertices = mesh::create_mesh_vertices(&mut scratch, &neighborhood, lod);
+        Loaded::Meshed(neighborhood.chunk, job, vertices)
+      },
+      Job::MeshSides(neighborhood, sides, job) => {
+        let vertices = mesh::create_side_vertices(&neighborhood, sides);
+        Loaded::SidesMeshed(neighborhood.chunk, job, sides, vertices)
+      },
+    };
+    if results.send(loaded).is_err() {
+      // Loader is gone.
+      return;
+    }
+  }
+}
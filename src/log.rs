@@ -10,8 +10,16 @@ macro_rules! log {
 }
 
 #[macro_escape]
-#[cfg(target_os = "linux")]
+#[cfg(all(target_os = "linux", not(feature = "bench")))]
 macro_rules! log {
   ($fmt:expr) => (println!($fmt));
   ($fmt:expr, $($arg:tt)*) => (println!($fmt, $($arg)*));
 }
+
+// Benchmarks print their own results, logging would only skew timings.
+#[macro_escape]
+#[cfg(feature = "bench")]
+macro_rules! log {
+  ($fmt:expr) => (());
+  ($fmt:expr, $($arg:tt)*) => ({ let _ = format_args!($fmt, $($arg)*); });
+}
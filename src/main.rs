@@ -1,4 +1,6 @@
 #![feature(start, slice_patterns)]
+// Benchmark builds leave the renderer unused.
+#![cfg_attr(feature = "bench", allow(dead_code, unused_imports))]
 
 #[macro_use]
 #[cfg(target_os = "android")]
@@ -10,7 +12,6 @@ extern crate lazy_static;
 extern crate cgmath;
 extern crate collision;
 extern crate libc;
-extern crate noise;
 #[cfg(target_os = "linux")]
 extern crate png;
 extern crate time;
@@ -28,11 +29,14 @@ use engine::Engine;
 #[cfg(target_os = "linux")]
 use program::Program;
 #[cfg(target_os = "linux")]
-use x11::{Event, XWindow};
+use x11::{ElementState, Event, VirtualKeyCode, XWindow};
 
 #[macro_use]
 mod log;
 
+#[cfg(feature = "bench")]
+mod bench;
+mod cave;
 #[cfg(target_os = "android")]
 mod egl;
 #[cfg(target_os = "android")]
@@ -40,10 +44,16 @@ mod egl_context;
 mod engine;
 mod fov;
 mod fps;
+mod frustum;
 mod gl;
+mod loader;
 mod mesh;
 mod perlin;
+mod pool;
 mod program;
+mod region;
+mod scheduler;
+mod tracker;
 mod world;
 #[cfg(target_os = "linux")]
 mod x11;
@@ -126,7 +136,12 @@ fn load_asset(filename: &str) -> Vec<u8> {
   }
 }
 
-#[cfg(target_os = "linux")]
+#[cfg(all(target_os = "linux", feature = "bench"))]
+pub fn main() {
+  bench::run();
+}
+
+#[cfg(all(target_os = "linux", not(feature = "bench")))]
 pub fn main() {
   log!("-------------------------------------------------------------------");
   let window = XWindow::new("Rusty Cardboard");
@@ -146,6 +161,10 @@ pub fn main() {
    }
 }
 
+/// How far the eye moves per arrow key press, in blocks.
+#[cfg(target_os = "linux")]
+const WALK_STEP: f32 = 4.0;
+
 #[cfg(target_os = "linux")]
 static TEXTURE_ATLAS: &'static [u8] = include_bytes!("../assets/atlas.png");
 
@@ -159,6 +178,7 @@ fn handle_events(engine: &mut Engine) {
 
   let mut focus_change: Option<FocusChange> = None;
   let mut resized_to: Option<(u32, u32)> = None;
+  let mut walk_distance = 0.0;
   for e in engine.poll_events() {
     match e {
       Event::Resized(w, h) => {
@@ -171,6 +191,12 @@ fn handle_events(engine: &mut Engine) {
           focus_change = Some(FocusChange::Lost);
         }
       },
+      Event::KeyboardInput(ElementState::Pressed, _, Some(VirtualKeyCode::Up)) => {
+        walk_distance += WALK_STEP;
+      },
+      Event::KeyboardInput(ElementState::Pressed, _, Some(VirtualKeyCode::Down)) => {
+        walk_distance -= WALK_STEP;
+      },
       _ => (),
     }
   }
@@ -183,4 +209,7 @@ fn handle_events(engine: &mut Engine) {
   if let Some((w, h)) = resized_to {
     engine.set_viewport(w as i32, h as i32);
   }
+  if walk_distance != 0.0 {
+    engine.walk(walk_distance);
+  }
 }
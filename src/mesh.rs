@@ -1,39 +1,110 @@
-use std::u16;
+use std::cmp;
+use std::collections::HashMap;
+use std::mem;
 
-use cgmath::Vector3;
+use cgmath::{Point3, Vector3};
 
+use cave::FaceConnectivity;
 use program::VertexArray;
-use world::{Block, World};
+use world::{Block, BlockId, CHUNK_SIZE, CHUNK_VOLUME, ChunkBlocks, EMPTY, Neighborhood};
 
+/// Which mesher turns chunk blocks into vertices.
+#[allow(dead_code)]
+#[derive(Clone, Copy, Debug, PartialEq)]
+pub enum Mesher {
+  /// One quad per visible block face.
+  Naive,
+  /// Merges adjacent coplanar visible faces with the same texture into larger quads.
+  Greedy,
+}
+
+pub const MESHER: Mesher = Mesher::Greedy;
+
+/// Distances in blocks from the FOV vertex to a chunk's center beyond which the chunk is meshed
+/// at the next level of detail.  Level n merges 2^n x 2^n x 2^n blocks into one voxel.
+pub const LOD_DISTANCES: [f32; 2] = [24.0, 40.0];
+
+/// Blocks a chunk's distance must be past a boundary of `LOD_DISTANCES` before a chunk already
+/// meshed switches level of detail, so an eye moving back and forth across the boundary does not
+/// remesh it each time.
+const LOD_HYSTERESIS: f32 = 1.5;
+
+/// Level of detail to mesh a chunk at, given the distance to its center.
+pub fn lod_for_distance(distance: f32) -> u32 {
+  LOD_DISTANCES.iter().filter(|&&d| distance > d).count() as u32
+}
+
+/// Level of detail to remesh a chunk meshed at lod at, given the distance to its center.  The
+/// boundaries of lod's band are moved out by `LOD_HYSTERESIS`.
+pub fn lod_for_distance_from(lod: u32, distance: f32) -> u32 {
+  LOD_DISTANCES.iter().enumerate().filter(|&(i, &d)| {
+    distance > if (i as u32) < lod { d - LOD_HYSTERESIS } else { d + LOD_HYSTERESIS }
+  }).count() as u32
+}
+
+/// Most quads a chunk mesh can have: every other block of a checkerboard shows all 6 faces.
+pub const MAX_QUADS: usize = 6 * ((CHUNK_VOLUME + 1) / 2);
+
+/// Position indices, point to face coordinates to form 2 counter-clockwise triangles.
+const QUAD_INDICES: [u16; 6] = [
+  0, 1, 3,
+  3, 1, 2,
+];
+
+/// Atlas tiles.
+const SIDE: [u8; 2] = [1, 1];
+const TOP: [u8; 2] = [0, 1];
+const BOTTOM: [u8; 2] = [0, 0];
+
+/// Packed vertex, 8 bytes.  Positions are chunk-local block corners, from 0 to CHUNK_SIZE on each
+/// axis, the shader adds the chunk origin.  Texture coordinates hold repeat counts running from 0
+/// to the quad size in blocks and the atlas tile.  The shaders wrap the repeat counts into the
+/// tile, so a merged quad repeats the texture once per block.
+///
 /// This has to have C layout since it is read by the OpenGL driver via a pointer passed to it.
 #[repr(C)]
-#[derive(Clone)]
+#[derive(Clone, Debug, Eq, Hash, PartialEq)]
 pub struct Coords {
-  xyz: [f32; 3],
-  st: [u16; 2]
+  /// x, y, z and padding.
+  xyz: [u8; 4],
+  /// s, t repeat counts, then tile s, t.
+  st: [u8; 4],
 }
 
 impl Coords {
   pub fn size_bytes() -> u32 {
-    3 * 4 + 2 * 2
+    4 + 4
   }
 
   pub fn texture_offset() -> u32 {
-    3 * 4
+    4
+  }
+
+  /// A vertex of quads with all corners in one point, which draw nothing.
+  pub fn degenerate() -> Coords {
+    Coords {
+      xyz: [0; 4],
+      st: [0; 4],
+    }
   }
 
-  pub fn translate(&self, x: f32, y: f32, z: f32) -> Coords {
+  pub fn translate(&self, x: u8, y: u8, z: u8) -> Coords {
     Coords {
       xyz: [
         self.xyz[0] + x,
         self.xyz[1] + y,
         self.xyz[2] + z,
+        0,
       ],
       st: self.st,
     }
   }
 }
 
+fn st(tile: [u8; 2], s: u8, t: u8) -> [u8; 4] {
+  [s, t, tile[0], tile[1]]
+}
+
 /// Each face consists of 2 triangles, 4 vertices total.
 pub struct CubeFace {
   /// Position and texture coordinates.
@@ -44,32 +115,26 @@ pub struct CubeFace {
 
 /// Cube faces in standard order: left, right, down, up, forward, back.
 lazy_static! {
-  // Position indices, point to face coordinates to form 2 counter-clockwise triangles.
-  static ref INDICES: [u16; 6] = [
-    0, 1, 3,
-    3, 1, 2,
-  ];
-
   // 6 cube faces in canonical order: left, right, down, up, forward, back.
   static ref CUBE_FACES: [CubeFace; 6] = [
     // Left.
     CubeFace {
       coords: [
         Coords {
-          xyz: [-0.5, -0.5, -0.5],
-          st: [0x7fff, 0xffff],
+          xyz: [0, 0, 0, 0],
+          st: st(SIDE, 0, 1),
         },
         Coords {
-          xyz: [-0.5, -0.5, 0.5],
-          st: [0xffff, 0xffff],
+          xyz: [0, 0, 1, 0],
+          st: st(SIDE, 1, 1),
         },
         Coords {
-          xyz: [-0.5, 0.5, 0.5],
-          st: [0xffff, 0x7fff],
+          xyz: [0, 1, 1, 0],
+          st: st(SIDE, 1, 0),
         },
         Coords {
-          xyz: [-0.5, 0.5, -0.5],
-          st: [0x7fff, 0x7fff],
+          xyz: [0, 1, 0, 0],
+          st: st(SIDE, 0, 0),
         },
       ],
       direction: Vector3::new(-1, 0, 0),
@@ -78,20 +143,20 @@ lazy_static! {
     CubeFace {
       coords: [
         Coords {
-          xyz: [0.5, -0.5, 0.5],
-          st: [0x7fff, 0xffff],
+          xyz: [1, 0, 1, 0],
+          st: st(SIDE, 0, 1),
         },
         Coords {
-          xyz: [0.5, -0.5, -0.5],
-          st: [0xffff, 0xffff],
+          xyz: [1, 0, 0, 0],
+          st: st(SIDE, 1, 1),
         },
         Coords {
-          xyz: [0.5, 0.5, -0.5],
-          st: [0xffff, 0x7fff],
+          xyz: [1, 1, 0, 0],
+          st: st(SIDE, 1, 0),
         },
         Coords {
-          xyz: [0.5, 0.5, 0.5],
-          st: [0x7fff, 0x7fff],
+          xyz: [1, 1, 1, 0],
+          st: st(SIDE, 0, 0),
         },
       ],
       direction: Vector3::new(1, 0, 0),
@@ -100,20 +165,20 @@ lazy_static! {
     CubeFace {
       coords: [
         Coords {
-          xyz: [-0.5, -0.5, -0.5],
-          st: [0x0000, 0x7fff],
+          xyz: [0, 0, 0, 0],
+          st: st(BOTTOM, 0, 1),
         },
         Coords {
-          xyz: [0.5, -0.5, -0.5],
-          st: [0x7fff, 0x7fff],
+          xyz: [1, 0, 0, 0],
+          st: st(BOTTOM, 1, 1),
         },
         Coords {
-          xyz: [0.5, -0.5, 0.5],
-          st: [0x7fff, 0x0000],
+          xyz: [1, 0, 1, 0],
+          st: st(BOTTOM, 1, 0),
         },
         Coords {
-          xyz: [-0.5, -0.5,  0.5],
-          st: [0x0000, 0x0000],
+          xyz: [0, 0, 1, 0],
+          st: st(BOTTOM, 0, 0),
         },
       ],
       direction: Vector3::new(0, -1, 0),
@@ -122,20 +187,20 @@ lazy_static! {
     CubeFace {
       coords: [
         Coords {
-          xyz: [-0.5, 0.5, 0.5],
-          st: [0x0000, 0xffff],
+          xyz: [0, 1, 1, 0],
+          st: st(TOP, 0, 1),
         },
         Coords {
-          xyz: [0.5, 0.5,  0.5],
-          st: [0x7fff, 0xffff],
+          xyz: [1, 1, 1, 0],
+          st: st(TOP, 1, 1),
         },
         Coords {
-          xyz: [0.5, 0.5, -0.5],
-          st: [0x7fff, 0x7fff],
+          xyz: [1, 1, 0, 0],
+          st: st(TOP, 1, 0),
         },
         Coords {
-          xyz: [-0.5, 0.5, -0.5],
-          st: [0x0000, 0x7fff],
+          xyz: [0, 1, 0, 0],
+          st: st(TOP, 0, 0),
         },
       ],
       direction: Vector3::new(0, 1, 0),
@@ -144,20 +209,20 @@ lazy_static! {
     CubeFace {
       coords: [
         Coords {
-          xyz: [0.5, -0.5, -0.5],
-          st: [0x7fff, 0xffff],
+          xyz: [1, 0, 0, 0],
+          st: st(SIDE, 0, 1),
         },
         Coords {
-          xyz: [-0.5, -0.5, -0.5],
-          st: [0xffff, 0xffff],
+          xyz: [0, 0, 0, 0],
+          st: st(SIDE, 1, 1),
         },
         Coords {
-          xyz: [-0.5, 0.5, -0.5],
-          st: [0xffff, 0x7fff],
+          xyz: [0, 1, 0, 0],
+          st: st(SIDE, 1, 0),
         },
         Coords {
-          xyz: [0.5,  0.5, -0.5],
-          st: [0x7fff, 0x7fff],
+          xyz: [1, 1, 0, 0],
+          st: st(SIDE, 0, 0),
         },
       ],
       direction: Vector3::new(0, 0, -1),
@@ -166,20 +231,20 @@ lazy_static! {
     CubeFace {
       coords: [
         Coords {
-          xyz: [-0.5, -0.5, 0.5],
-          st: [0x7fff, 0xffff],
+          xyz: [0, 0, 1, 0],
+          st: st(SIDE, 0, 1),
         },
         Coords {
-          xyz: [0.5, -0.5, 0.5],
-          st: [0xffff, 0xffff],
+          xyz: [1, 0, 1, 0],
+          st: st(SIDE, 1, 1),
         },
         Coords {
-          xyz: [0.5, 0.5, 0.5],
-          st: [0xffff, 0x7fff],
+          xyz: [1, 1, 1, 0],
+          st: st(SIDE, 1, 0),
         },
         Coords {
-          xyz: [-0.5, 0.5, 0.5],
-          st: [0x7fff, 0x7fff],
+          xyz: [0, 1, 1, 0],
+          st: st(SIDE, 0, 0),
         },
       ],
       direction: Vector3::new(0, 0, 1),
@@ -188,29 +253,75 @@ lazy_static! {
 }
 
 pub struct Vertices {
+  /// World position of local corner (0, 0, 0).
+  origin: [f32; 3],
+  /// Quads of each face direction one after another, in `CUBE_FACES` order.
   coords: Vec<Coords>,
-  indices: Vec<u16>,
+  /// Number of quads of each face direction.
+  face_quads: [u32; 6],
+  /// Level of detail the mesh was built at.
+  lod: u32,
+  /// Which sides of the chunk see each other through empty blocks.
+  connectivity: FaceConnectivity,
+  /// Blocks along each axis the mesh spans from origin.
+  extent: i32,
 }
 
 impl Vertices {
-  pub fn new(cube_count: usize) -> Vertices {
+  /// Vertices of the chunk whose lowest block is at origin.
+  pub fn new(origin: &Block, lod: u32) -> Vertices {
+    Vertices::with_coords(origin, lod, Vec::new())
+  }
+
+  /// Vertices of the chunk whose lowest block is at origin, adding quads to coords after clearing
+  /// it.
+  fn with_coords(origin: &Block, lod: u32, mut coords: Vec<Coords>) -> Vertices {
+    coords.clear();
     Vertices {
-      // If the world nas N cubes in it, the mesh may have up to 6 * N faces
-      // and up to 6 * 4 * N vertices.  Set capacity to half of that since some
-      // faces will be hidden.
-      coords: Vec::with_capacity(12 * cube_count),
-      // Up to 6 * 6 * N indices, halve it.
-      indices: Vec::with_capacity(18 * cube_count),
+      origin: [origin.x as f32 - 0.5, origin.y as f32 - 0.5, origin.z as f32 - 0.5],
+      coords: coords,
+      face_quads: [0; 6],
+      lod: lod,
+      connectivity: FaceConnectivity::all(),
+      extent: CHUNK_SIZE,
     }
   }
 
-  pub fn add(&mut self, coords: &[Coords; 4], indices: &[u16; 6]) {
-    let old_vertex_count = self.coords.len();
-    let new_vertex_count = old_vertex_count + 4;
-    assert!(new_vertex_count <= u16::MAX as usize, "Too many vertices: {}", new_vertex_count);
+  /// Concatenates meshes into one spanning extent blocks from origin, each translated by its
+  /// offset in blocks from origin.  Quads of each face direction stay together.  `None` if the
+  /// quads do not fit the shared indices.
+  pub fn merge(origin: &Block, extent: i32, parts: &[(&Vertices, [u8; 3])]) -> Option<Vertices> {
+    let quads: usize = parts.iter().map(|&(v, _)| v.coords.len() / 4).sum();
+    if quads > MAX_QUADS {
+      return None;
+    }
+    let lod = parts.iter().map(|&(v, _)| v.lod).min().unwrap_or(0);
+    let mut merged = Vertices::new(origin, lod);
+    merged.extent = extent;
+    merged.coords.reserve(4 * quads);
+    for i in 0..6 {
+      for &(v, offset) in parts.iter() {
+        let start = 4 * v.face_quads[..i].iter().sum::<u32>() as usize;
+        let end = start + 4 * v.face_quads[i] as usize;
+        merged.coords.extend(v.coords[start..end].iter()
+          .map(|c| c.translate(offset[0], offset[1], offset[2])));
+        merged.face_quads[i] += v.face_quads[i];
+      }
+    }
+    Some(merged)
+  }
 
+  /// Adds a quad of face direction i, drawn with the shared indices from `quad_indices`.  Quads
+  /// have to be added in face direction order.
+  pub fn add(&mut self, i: usize, coords: &[Coords; 4]) {
+    assert!(self.coords.len() / 4 < MAX_QUADS, "Too many quads: {}", self.coords.len() / 4 + 1);
+    debug_assert!(self.face_quads[i + 1..].iter().all(|&q| q == 0), "Face {} out of order", i);
     self.coords.extend(coords.into_iter().cloned());
-    self.indices.extend(shift(indices, old_vertex_count as u16).into_iter());
+    self.face_quads[i] += 1;
+  }
+
+  pub fn origin(&self) -> [f32; 3] {
+    self.origin
   }
 
   pub fn coords(&self) -> &[Coords] {
@@ -221,6 +332,126 @@ impl Vertices {
     self.coords.len()
   }
 
+  pub fn face_quads(&self) -> [u32; 6] {
+    self.face_quads
+  }
+
+  pub fn lod(&self) -> u32 {
+    self.lod
+  }
+
+  pub fn connectivity(&self) -> FaceConnectivity {
+    self.connectivity
+  }
+
+  pub fn extent(&self) -> i32 {
+    self.extent
+  }
+
+  /// This mesh with quads on the chunk's sides in the face directions set in sides swapped for
+  /// those of a mesh of just these sides.  Both meshes must be at full detail.
+  pub fn with_sides(&self, sides: u32, side_vertices: &Vertices) -> Vertices {
+    debug_assert!(self.lod == 0 && side_vertices.lod == 0);
+    let mut coords = Vec::with_capacity(self.coords.len() + side_vertices.coords.len());
+    let mut face_quads = [0; 6];
+    let (mut start, mut side_start) = (0, 0);
+    for (i, face) in CUBE_FACES.iter().enumerate() {
+      let end = start + 4 * self.face_quads[i] as usize;
+      let side_end = side_start + 4 * side_vertices.face_quads[i] as usize;
+      let face_start = coords.len();
+      if sides & 1 << i != 0 {
+        let (n, (_, plane)) = (FaceAxes::new(face).n, side_slice(i));
+        for quad in self.coords[start..end].chunks(4).filter(|q| q[0].xyz[n] != plane) {
+          coords.extend_from_slice(quad);
+        }
+        coords.extend_from_slice(&side_vertices.coords[side_start..side_end]);
+      } else {
+        coords.extend_from_slice(&self.coords[start..end]);
+      }
+      face_quads[i] = ((coords.len() - face_start) / 4) as u32;
+      start = end;
+      side_start = side_end;
+    }
+    Vertices {
+      origin: self.origin,
+      coords: coords,
+      face_quads: face_quads,
+      lod: self.lod,
+      connectivity: self.connectivity,
+      extent: self.extent,
+    }
+  }
+
+  /// Reorders quads within each face direction to keep those also in old where they were in old,
+  /// quads of a direction draw the same in any order.  New quads fill the places of removed ones
+  /// and then go last, or if there are fewer quads than before, the last ones fill the places
+  /// left.  Returns the runs of quads differing from old as (face direction, first quad of the
+  /// direction, quads), runs reach past the direction's quads where old had more.
+  pub fn arrange_like(mut self, old: &Vertices) -> (Vertices, Vec<(usize, u32, u32)>) {
+    let mut coords = Vec::with_capacity(self.coords.len());
+    let mut changed = Vec::new();
+    let (mut start, mut old_start) = (0, 0);
+    for i in 0..6 {
+      let (nq, oq) = (self.face_quads[i] as usize, old.face_quads[i] as usize);
+      let n = &self.coords[start..start + 4 * nq];
+      let mut unplaced: HashMap<&[Coords], u32> = HashMap::new();
+      for quad in n.chunks(4) {
+        *unplaced.entry(quad).or_insert(0) += 1;
+      }
+      let mut slots: Vec<Option<&[Coords]>> = old.coords[old_start..old_start + 4 * oq].chunks(4)
+        .map(|quad| if take(&mut unplaced, quad) { Some(quad) } else { None })
+        .collect();
+
+      let mut rewritten = Vec::new();
+      {
+        let mut added = n.chunks(4).filter(|quad| take(&mut unplaced, quad));
+        for q in 0..oq {
+          if slots[q].is_none() {
+            slots[q] = added.next();
+            rewritten.push(q);
+          }
+        }
+        for quad in added {
+          rewritten.push(slots.len());
+          slots.push(Some(quad));
+        }
+      }
+      let mut hole = 0;
+      while slots.len() > nq {
+        if let Some(quad) = slots.pop().unwrap() {
+          while slots[hole].is_some() {
+            hole += 1;
+          }
+          slots[hole] = Some(quad);
+          rewritten.push(hole);
+        }
+      }
+      for quad in slots.iter() {
+        coords.extend_from_slice(quad.unwrap());
+      }
+
+      rewritten.retain(|&q| q < nq);
+      rewritten.extend(nq..oq);
+      rewritten.sort();
+      rewritten.dedup();
+      for q in rewritten.into_iter().map(|q| q as u32) {
+        let extends = match changed.last() {
+          Some(&(face, first, quads)) => face == i && first + quads == q,
+          None => false,
+        };
+        if extends {
+          changed.last_mut().unwrap().2 += 1;
+        } else {
+          changed.push((i, q, 1));
+        }
+      }
+      start += 4 * nq;
+      old_start += 4 * oq;
+    }
+    self.coords = coords;
+    (self, changed)
+  }
+
   pub fn position_coord_array(&self) -> VertexArray {
     VertexArray {
       components: 3,
@@ -230,51 +461,495 @@ impl Vertices {
 
   pub fn texture_coord_array(&self) -> VertexArray {
     VertexArray {
-      components: 2,
+      components: 4,
       stride: Coords::size_bytes(),
     }
   }
+}
 
-  pub fn indices(&self) -> &[u16] {
-    &self.indices[..]
+/// Takes one of a quad's count in a multiset of quads, false if none are left.
+fn take(quads: &mut HashMap<&[Coords], u32>, quad: &[Coords]) -> bool {
+  match quads.get_mut(quad) {
+    Some(count) => {
+      if *count == 0 {
+        return false;
+      }
+      *count -= 1;
+      true
+    },
+    None => false,
   }
+}
 
-  pub fn index_count(&self) -> usize {
-    self.indices.len()
+/// Indices for MAX_QUADS quads, each 4 vertices after the previous one.  Every chunk mesh is drawn
+/// with a prefix of them.
+pub fn quad_indices() -> Vec<u16> {
+  let mut indices = Vec::with_capacity(6 * MAX_QUADS);
+  for quad in 0..MAX_QUADS {
+    let first = (4 * quad) as u16;
+    indices.extend(QUAD_INDICES.iter().map(|i| first + i));
   }
+  indices
 }
 
-fn shift(indices: &[u16; 6], by: u16) -> [u16; 6] {
-  [
-    indices[0] + by,
-    indices[1] + by,
-    indices[2] + by,
-    indices[3] + by,
-    indices[4] + by,
-    indices[5] + by,
-  ]
+/// Quads of the box around a chunk, in chunk-local coordinates like chunk meshes.
+pub fn chunk_box() -> Vec<Coords> {
+  let size = CHUNK_SIZE as u8;
+  CUBE_FACES.iter().flat_map(|face| face.coords.iter().map(move |c| Coords {
+    xyz: [c.xyz[0] * size, c.xyz[1] * size, c.xyz[2] * size, 0],
+    st: c.st,
+  })).collect()
 }
 
-pub fn create_mesh_vertices(blocks: &Vec<Block>, world: &World) -> Vertices {
-  let mut vertices = Vertices::new(world.len());
-  for block in blocks {
-    // Eliminate definitely invisible faces, i.e. those between two neighboring cubes.
-    for face in CUBE_FACES.iter() {
-      if !world.contains(&(block + face.direction)) {
-        vertices.add(&translate(&face.coords, block), &INDICES);
-      }
+/// Which face directions of a mesh spanning extent blocks from origin may face the eye.  Faces of
+/// a direction all face away once the eye is past the mesh's far side along it.
+pub fn facing_faces(origin: &[f32; 3], extent: f32, eye: &Point3<f32>) -> [bool; 6] {
+  let eye = [eye.x, eye.y, eye.z];
+  let mut facing = [true; 6];
+  for (i, face) in CUBE_FACES.iter().enumerate() {
+    let direction = [face.direction.x, face.direction.y, face.direction.z];
+    let n = direction.iter().position(|&d| d != 0).unwrap();
+    facing[i] = if direction[n] > 0 {
+      eye[n] > origin[n]
+    } else {
+      eye[n] < origin[n] + extent
+    };
+  }
+  facing
+}
+
+/// Meshes just the chunk's sides in the face directions set in sides, at full detail.  Only these
+/// faces depend on the neighbors on those sides, see `Vertices::with_sides`.  Sides are always
+/// merged greedily.
+pub fn create_side_vertices(neighborhood: &Neighborhood, sides: u32) -> Vertices {
+  let mut vertices = Vertices::new(&neighborhood.blocks.origin(), 0);
+  let exposed = ExposedFaces::new(neighborhood);
+  let mut mask = [EMPTY; (CHUNK_SIZE * CHUNK_SIZE) as usize];
+  for (i, face) in CUBE_FACES.iter().enumerate() {
+    if sides & 1 << i != 0 {
+      let (slice, _) = side_slice(i);
+      mesh_greedy_slice(&exposed, i, &FaceAxes::new(face), slice, &mut mask, &mut vertices);
     }
   }
   vertices
 }
 
-/// Accepts vertex and texture coordinates.  Translates vertex coordinates only along the vector
-// corresponding to the block center position.
-fn translate(coords: &[Coords; 4], block: &Block) -> [Coords; 4] {
-  let x = block.x as f32;
-  let y = block.y as f32;
-  let z = block.z as f32;
+/// Buffers reused from one chunk to the next by a meshing thread.  Meshes are built in them, and
+/// only the finished mesh gets a newly allocated, exactly sized buffer.
+pub struct MeshScratch {
+  coords: Vec<Coords>,
+  /// Voxels of coarse levels of detail.
+  voxels: Vec<BlockId>,
+  /// Flood fill state for face connectivity.
+  visited: Vec<bool>,
+  stack: Vec<(i32, i32, i32)>,
+}
+
+impl MeshScratch {
+  pub fn new() -> MeshScratch {
+    MeshScratch {
+      coords: Vec::new(),
+      voxels: Vec::new(),
+      visited: Vec::new(),
+      stack: Vec::new(),
+    }
+  }
+}
+
+/// Meshes a chunk at a level of detail.  Coarser levels always use the greedy mesher.  Also finds
+/// the chunk's face connectivity, at full detail.
+pub fn create_mesh_vertices(scratch: &mut MeshScratch, neighborhood: &Neighborhood, lod: u32)
+  -> Vertices {
+
+  let coords = mem::replace(&mut scratch.coords, Vec::new());
+  let mut vertices = Vertices::with_coords(&neighborhood.blocks.origin(), lod, coords);
+  match (MESHER, lod) {
+    (Mesher::Naive, 0) => mesh_naive(neighborhood, &mut vertices),
+    (Mesher::Greedy, 0) => mesh_greedy(&ExposedFaces::new(neighborhood), &mut vertices),
+    _ => {
+      let ids = mem::replace(&mut scratch.voxels, Vec::new());
+      let voxels = CoarseVoxels::new(&neighborhood.blocks, 1 << lod, ids);
+      mesh_greedy(&voxels, &mut vertices);
+      scratch.voxels = voxels.ids;
+    },
+  }
+  vertices.connectivity = FaceConnectivity::with_scratch(&neighborhood.blocks,
+    &mut scratch.visited, &mut scratch.stack);
+  // Hand the scratch buffer back and keep an exactly sized copy.
+  let exact = vertices.coords.to_vec();
+  scratch.coords = mem::replace(&mut vertices.coords, exact);
+  vertices
+}
+
+/// Cubic grid of voxels the greedy mesher turns into faces.
+trait Voxels {
+  /// Voxels along each axis.
+  fn size(&self) -> i32;
+  /// Blocks along each axis of a voxel.  The last voxel along an axis may be cut short by the
+  /// chunk's end.
+  fn block_size(&self) -> i32;
+  fn get(&self, x: i32, y: i32, z: i32) -> BlockId;
+  /// Whether face i of the non-empty voxel at (x, y, z) is not covered by the adjacent voxel.
+  fn face_visible(&self, i: usize, x: i32, y: i32, z: i32) -> bool;
+
+  /// Sets mask[v * size + u] to the id of the voxel at (u, v) in a slice if its face i is visible,
+  /// else to `EMPTY`.  Returns whether any face is visible.
+  fn fill_mask(&self, i: usize, axes: &FaceAxes, slice: i32, mask: &mut [BlockId]) -> bool {
+    let size = self.size();
+    let mut any = false;
+    for v in 0..size {
+      for u in 0..size {
+        let local = axes.local(slice, u, v);
+        // Only one block type for now, its id stands for the texture.
+        let mut id = self.get(local[0], local[1], local[2]);
+        if id != EMPTY && !self.face_visible(i, local[0], local[1], local[2]) {
+          id = EMPTY;
+        }
+        mask[(v * size + u) as usize] = id;
+        any |= id != EMPTY;
+      }
+    }
+    any
+  }
+}
+
+/// Rows of blocks along x, one per (y, z), in the padded grid `ExposedFaces` builds them in.
+const PADDED_SIZE: i32 = CHUNK_SIZE + 2;
+
+/// Bits of a row's blocks within the chunk.
+const ROW_BITS: u32 = (1 << CHUNK_SIZE) - 1;
+
+/// A chunk's visible block faces as bit masks.  For each face direction, the row of blocks along
+/// x at each (y, z) has bit x set where the block's face is not covered.  Built from the chunk's
+/// solid blocks padded with its neighbors' bordering blocks, one row of bits at a time.
+struct ExposedFaces<'a> {
+  blocks: &'a ChunkBlocks,
+  /// Rows of each face direction in `CUBE_FACES` order, indexed by y * CHUNK_SIZE + z.
+  rows: [[u32; (CHUNK_SIZE * CHUNK_SIZE) as usize]; 6],
+}
+
+impl<'a> ExposedFaces<'a> {
+  fn new(neighborhood: &'a Neighborhood) -> ExposedFaces<'a> {
+    let blocks = &neighborhood.blocks;
+    // Bit x + 1 of row (y + 1) * PADDED_SIZE + z + 1 is set for a solid block at local (x, y, z).
+    let mut solid = [0u32; (PADDED_SIZE * PADDED_SIZE) as usize];
+    let row = |y: i32, z: i32| ((y + 1) * PADDED_SIZE + z + 1) as usize;
+    for y in 0..CHUNK_SIZE {
+      for z in 0..CHUNK_SIZE {
+        let mut bits = 0;
+        for x in 0..CHUNK_SIZE {
+          bits |= (blocks.contains_local(x, y, z) as u32) << (x + 1);
+        }
+        solid[row(y, z)] = bits;
+      }
+    }
+    // Missing neighbors count as empty, faces on their side stay visible.
+    let last = CHUNK_SIZE - 1;
+    for a in 0..CHUNK_SIZE {
+      for b in 0..CHUNK_SIZE {
+        if let Some(ref n) = neighborhood.neighbors[0] {
+          solid[row(a, b)] |= n.contains_local(last, a, b) as u32;
+        }
+        if let Some(ref n) = neighborhood.neighbors[1] {
+          solid[row(a, b)] |= (n.contains_local(0, a, b) as u32) << (CHUNK_SIZE + 1);
+        }
+        if let Some(ref n) = neighborhood.neighbors[2] {
+          solid[row(-1, a)] |= (n.contains_local(b, last, a) as u32) << (b + 1);
+        }
+        if let Some(ref n) = neighborhood.neighbors[3] {
+          solid[row(CHUNK_SIZE, a)] |= (n.contains_local(b, 0, a) as u32) << (b + 1);
+        }
+        if let Some(ref n) = neighborhood.neighbors[4] {
+          solid[row(a, -1)] |= (n.contains_local(b, a, last) as u32) << (b + 1);
+        }
+        if let Some(ref n) = neighborhood.neighbors[5] {
+          solid[row(a, CHUNK_SIZE)] |= (n.contains_local(b, a, 0) as u32) << (b + 1);
+        }
+      }
+    }
+
+    let mut rows = [[0; (CHUNK_SIZE * CHUNK_SIZE) as usize]; 6];
+    for y in 0..CHUNK_SIZE {
+      for z in 0..CHUNK_SIZE {
+        let s = solid[row(y, z)];
+        // A face shows where the block is solid and the one beyond it is not.
+        let covers = [s << 1, s >> 1, solid[row(y - 1, z)], solid[row(y + 1, z)],
+          solid[row(y, z - 1)], solid[row(y, z + 1)]];
+        let i = (y * CHUNK_SIZE + z) as usize;
+        for (face, cover) in covers.iter().enumerate() {
+          rows[face][i] = (s & !cover) >> 1 & ROW_BITS;
+        }
+      }
+    }
+    ExposedFaces {
+      blocks: blocks,
+      rows: rows,
+    }
+  }
+
+  /// Bit x set where face i of the block at local (x, y, z) is visible.
+  #[inline]
+  fn row(&self, i: usize, y: i32, z: i32) -> u32 {
+    self.rows[i][(y * CHUNK_SIZE + z) as usize]
+  }
+}
+
+impl<'a> Voxels for ExposedFaces<'a> {
+  fn size(&self) -> i32 {
+    CHUNK_SIZE
+  }
+
+  fn block_size(&self) -> i32 {
+    1
+  }
+
+  #[inline]
+  fn get(&self, x: i32, y: i32, z: i32) -> BlockId {
+    self.blocks.get_local(x, y, z)
+  }
+
+  #[inline]
+  fn face_visible(&self, i: usize, x: i32, y: i32, z: i32) -> bool {
+    self.row(i, y, z) & 1 << x != 0
+  }
+
+  /// Visits only the set bits of the rows in the slice.
+  fn fill_mask(&self, i: usize, axes: &FaceAxes, slice: i32, mask: &mut [BlockId]) -> bool {
+    for m in mask.iter_mut() {
+      *m = EMPTY;
+    }
+    let mut any = false;
+    let mut visit = |x: i32, y: i32, z: i32| {
+      let local = [x, y, z];
+      mask[(local[axes.v] * CHUNK_SIZE + local[axes.u]) as usize] = self.get(x, y, z);
+      any = true;
+    };
+    if axes.n == 0 {
+      // Rows run along x, a slice across x takes one bit of each.
+      for y in 0..CHUNK_SIZE {
+        for z in 0..CHUNK_SIZE {
+          if self.row(i, y, z) & 1 << slice != 0 {
+            visit(slice, y, z);
+          }
+        }
+      }
+    } else {
+      // Other slices take whole rows.
+      for a in 0..CHUNK_SIZE {
+        let (y, z) = if axes.n == 1 { (slice, a) } else { (a, slice) };
+        let mut bits = self.row(i, y, z);
+        while bits != 0 {
+          visit(bits.trailing_zeros() as i32, y, z);
+          bits &= bits - 1;
+        }
+      }
+    }
+    any
+  }
+}
+
+/// A chunk's blocks merged into voxels of block_size^3 blocks.  A voxel is solid if any of its
+/// blocks is, so the coarse mesh encloses everything the full one does.  Its faces on the chunk's
+/// sides are all visible, neighbors at other levels of detail need not match them.  Together this
+/// leaves no cracks between chunks of different levels, the coarser side covers any gap.
+struct CoarseVoxels {
+  size: i32,
+  block_size: i32,
+  ids: Vec<BlockId>,
+}
+
+impl CoarseVoxels {
+  /// Fills ids, whatever it held, with the voxels.
+  fn new(blocks: &ChunkBlocks, block_size: i32, mut ids: Vec<BlockId>) -> CoarseVoxels {
+    let size = (CHUNK_SIZE + block_size - 1) / block_size;
+    ids.clear();
+    ids.resize((size * size * size) as usize, EMPTY);
+    for y in 0..CHUNK_SIZE {
+      for z in 0..CHUNK_SIZE {
+        for x in 0..CHUNK_SIZE {
+          let id = blocks.get_local(x, y, z);
+          if id != EMPTY {
+            let (vx, vy, vz) = (x / block_size, y / block_size, z / block_size);
+            let i = ((vy * size + vz) * size + vx) as usize;
+            if ids[i] == EMPTY {
+              ids[i] = id;
+            }
+          }
+        }
+      }
+    }
+    CoarseVoxels {
+      size: size,
+      block_size: block_size,
+      ids: ids,
+    }
+  }
+}
+
+impl Voxels for CoarseVoxels {
+  fn size(&self) -> i32 {
+    self.size
+  }
+
+  fn block_size(&self) -> i32 {
+    self.block_size
+  }
+
+  #[inline]
+  fn get(&self, x: i32, y: i32, z: i32) -> BlockId {
+    self.ids[((y * self.size + z) * self.size + x) as usize]
+  }
+
+  #[inline]
+  fn face_visible(&self, i: usize, x: i32, y: i32, z: i32) -> bool {
+    let direction = &CUBE_FACES[i].direction;
+    let (nx, ny, nz) = (x + direction.x, y + direction.y, z + direction.z);
+    let inside = |c: i32| c >= 0 && c < self.size;
+    !(inside(nx) && inside(ny) && inside(nz)) || self.get(nx, ny, nz) == EMPTY
+  }
+}
+
+fn mesh_naive(neighborhood: &Neighborhood, vertices: &mut Vertices) {
+  let exposed = ExposedFaces::new(neighborhood);
+  for (i, face) in CUBE_FACES.iter().enumerate() {
+    for y in 0..CHUNK_SIZE {
+      for z in 0..CHUNK_SIZE {
+        // Faces between two neighboring cubes are never set.
+        let mut bits = exposed.row(i, y, z);
+        while bits != 0 {
+          let x = bits.trailing_zeros();
+          bits &= bits - 1;
+          vertices.add(i, &translate(&face.coords, x as u8, y as u8, z as u8));
+        }
+      }
+    }
+  }
+}
+
+/// Sweeps each face direction slice by slice.  Visible faces in a slice go into a mask, which is
+/// then covered by rectangles grown first along u, then along v.
+fn mesh_greedy<V: Voxels>(voxels: &V, vertices: &mut Vertices) {
+  let mut mask = [EMPTY; (CHUNK_SIZE * CHUNK_SIZE) as usize];
+  for (i, face) in CUBE_FACES.iter().enumerate() {
+    let axes = FaceAxes::new(face);
+    for slice in 0..voxels.size() {
+      mesh_greedy_slice(voxels, i, &axes, slice, &mut mask, vertices);
+    }
+  }
+}
+
+/// Adds the merged quads of face i in one slice.
+fn mesh_greedy_slice<V: Voxels>(voxels: &V, i: usize, axes: &FaceAxes, slice: i32,
+  mask: &mut [BlockId], vertices: &mut Vertices) {
+
+  if !voxels.fill_mask(i, axes, slice, mask) {
+    return;
+  }
+  let size = voxels.size() as usize;
+  for v in 0..size {
+    let mut u = 0;
+    while u < size {
+      let id = mask[v * size + u];
+      if id == EMPTY {
+        u += 1;
+        continue;
+      }
+      let mut width = 1;
+      while u + width < size && mask[v * size + u + width] == id {
+        width += 1;
+      }
+      let mut height = 1;
+      'grow: while v + height < size {
+        for k in 0..width {
+          if mask[(v + height) * size + u + k] != id {
+            break 'grow;
+          }
+        }
+        height += 1;
+      }
+      for dv in 0..height {
+        for du in 0..width {
+          mask[(v + dv) * size + u + du] = EMPTY;
+        }
+      }
+      let coords = axes.quad(&CUBE_FACES[i], voxels.block_size() as u8, slice as u8, u as u8,
+        v as u8, width as u8, height as u8);
+      vertices.add(i, &coords);
+      u += width;
+    }
+  }
+}
 
+/// The slice of face i on the chunk's side in its direction, and the plane its quads lie in.
+fn side_slice(i: usize) -> (i32, u8) {
+  let d = &CUBE_FACES[i].direction;
+  if d.x + d.y + d.z > 0 {
+    (CHUNK_SIZE - 1, CHUNK_SIZE as u8)
+  } else {
+    (0, 0)
+  }
+}
+
+/// Axes of a face: n along its normal, u and v spanning its plane.
+struct FaceAxes {
+  n: usize,
+  u: usize,
+  v: usize,
+  /// Whether the texture s coordinate runs along u (otherwise along v).
+  s_along_u: bool,
+}
+
+impl FaceAxes {
+  fn new(face: &CubeFace) -> FaceAxes {
+    let direction = [face.direction.x, face.direction.y, face.direction.z];
+    let n = direction.iter().position(|&d| d != 0).unwrap();
+    let (u, v) = ((n + 1) % 3, (n + 2) % 3);
+    // Corners 0 and 1 differ along the axis s runs along.
+    let (c0, c1) = (&face.coords[0].xyz, &face.coords[1].xyz);
+    FaceAxes {
+      n: n,
+      u: u,
+      v: v,
+      s_along_u: c0[u] != c1[u],
+    }
+  }
+
+  /// Local block coordinates of the block at (u, v) in a slice.
+  fn local(&self, slice: i32, u: i32, v: i32) -> [i32; 3] {
+    let mut local = [0; 3];
+    local[self.n] = slice;
+    local[self.u] = u;
+    local[self.v] = v;
+    local
+  }
+
+  /// Stretches the face's unit quad over width x height voxels of block_size^3 blocks starting at
+  /// (u, v).  Textures repeat once per block whatever the voxel size.
+  fn quad(&self, face: &CubeFace, block_size: u8, slice: u8, u: u8, v: u8, width: u8, height: u8)
+    -> [Coords; 4] {
+
+    // Block corner of a voxel corner, the chunk's last voxels may be cut short.
+    let edge = |voxel: u8| cmp::min(voxel as i32 * block_size as i32, CHUNK_SIZE) as u8;
+    let (u_blocks, v_blocks) = (edge(u + width) - edge(u), edge(v + height) - edge(v));
+    let (s_size, t_size) = if self.s_along_u { (u_blocks, v_blocks) } else { (v_blocks, u_blocks) };
+    let corner = |c: &Coords| {
+      let mut xyz = [0; 4];
+      xyz[self.n] = edge(slice + c.xyz[self.n]);
+      xyz[self.u] = edge(u + c.xyz[self.u] * width);
+      xyz[self.v] = edge(v + c.xyz[self.v] * height);
+      Coords {
+        xyz: xyz,
+        st: [c.st[0] * s_size, c.st[1] * t_size, c.st[2], c.st[3]],
+      }
+    };
+    [corner(&face.coords[0]), corner(&face.coords[1]), corner(&face.coords[2]),
+      corner(&face.coords[3])]
+  }
+}
+
+/// Accepts vertex and texture coordinates.  Translates vertex coordinates only, to the corner of
+/// the block at local (x, y, z).
+fn translate(coords: &[Coords; 4], x: u8, y: u8, z: u8) -> [Coords; 4] {
   [
     coords[0].translate(x, y, z),
     coords[1].translate(x, y, z),
@@ -282,3 +957,378 @@ fn translate(coords: &[Coords; 4], block: &Block) -> [Coords; 4] {
     coords[3].translate(x, y, z),
   ]
 }
+
+#[cfg(test)]
+mod tests {
+  use std::cmp;
+  use std::sync::Arc;
+  use world::{Block, Chunk, ChunkBlocks, EMPTY, Neighborhood, SOLID};
+  use std::u16;
+  use cgmath::Point3;
+  use world::CHUNK_SIZE;
+  use super::{CUBE_FACES, Coords, ExposedFaces, MAX_QUADS, MeshScratch, Vertices, chunk_box,
+    create_mesh_vertices, create_side_vertices, facing_faces, lod_for_distance,
+    lod_for_distance_from, mesh_greedy, mesh_naive, quad_indices};
+
+  fn neighborhood(blocks: ChunkBlocks) -> Neighborhood {
+    Neighborhood {
+      chunk: Chunk::new(0, 0, 0),
+      blocks: Arc::new(blocks),
+      neighbors: [None, None, None, None, None, None],
+    }
+  }
+
+  fn naive(n: &Neighborhood) -> Vertices {
+    let mut vertices = Vertices::new(&n.blocks.origin(), 0);
+    mesh_naive(n, &mut vertices);
+    vertices
+  }
+
+  fn greedy(n: &Neighborhood) -> Vertices {
+    let mut vertices = Vertices::new(&n.blocks.origin(), 0);
+    mesh_greedy(&ExposedFaces::new(n), &mut vertices);
+    vertices
+  }
+
+  /// Whether face i of the block at local (x, y, z) is not covered by the adjacent block, looked
+  /// up one block at a time.
+  fn face_visible(n: &Neighborhood, i: usize, x: i32, y: i32, z: i32) -> bool {
+    let direction = &CUBE_FACES[i].direction;
+    let (nx, ny, nz) = (x + direction.x, y + direction.y, z + direction.z);
+    let wrap = |local: i32| (local + CHUNK_SIZE) % CHUNK_SIZE;
+    if ChunkBlocks::in_chunk(nx, ny, nz) {
+      !n.blocks.contains_local(nx, ny, nz)
+    } else {
+      match n.neighbors[i] {
+        Some(ref b) => !b.contains_local(wrap(nx), wrap(ny), wrap(nz)),
+        None => true,
+      }
+    }
+  }
+
+  /// Number of block faces covered by quads.
+  fn face_area(vertices: &Vertices) -> f32 {
+    area(vertices.coords())
+  }
+
+  /// Number of block faces covered by quads, per face direction.
+  fn face_areas(vertices: &Vertices) -> Vec<f32> {
+    let mut start = 0;
+    vertices.face_quads().iter().map(|&quads| {
+      let end = start + 4 * quads as usize;
+      let a = area(&vertices.coords()[start..end]);
+      start = end;
+      a
+    }).collect()
+  }
+
+  fn area(coords: &[Coords]) -> f32 {
+    coords.chunks(4).map(|quad| {
+      let mut extents = [0.0; 3];
+      for axis in 0..3 {
+        let min = quad.iter().map(|c| c.xyz[axis]).min().unwrap();
+        let max = quad.iter().map(|c| c.xyz[axis]).max().unwrap();
+        extents[axis] = (max - min) as f32;
+      }
+      extents.iter().filter(|&&e| e > 0.0).fold(1.0, |a, e| a * e)
+    }).sum()
+  }
+
+  /// A flat slab gets one quad per side.
+  #[test]
+  fn greedy_merges_slab() {
+    let bounds = Chunk::new(0, 0, 0).block_bounds();
+    let mut blocks = ChunkBlocks::new(&bounds);
+    for z in bounds.min.z..bounds.max.z + 1 {
+      for x in bounds.min.x..bounds.max.x + 1 {
+        blocks.set(&Block::new(x, bounds.min.y, z), SOLID);
+        blocks.set(&Block::new(x, bounds.min.y + 1, z), SOLID);
+      }
+    }
+    let n = neighborhood(blocks);
+    let greedy = greedy(&n);
+    let naive = naive(&n);
+    assert_eq!(6 * 4, greedy.coord_count());
+    assert_eq!(face_area(&naive), face_area(&greedy));
+  }
+
+  /// Merged quads cover exactly the faces the naive mesher emits.
+  #[test]
+  fn greedy_covers_naive_faces() {
+    let bounds = Chunk::new(0, 0, 0).block_bounds();
+    let mut blocks = ChunkBlocks::new(&bounds);
+    for z in bounds.min.z..bounds.max.z + 1 {
+      for x in bounds.min.x..bounds.max.x + 1 {
+        let top = bounds.min.y + ((x * 7 + z * 3) & 5);
+        for y in bounds.min.y..top + 1 {
+          blocks.set(&Block::new(x, y, z), SOLID);
+        }
+      }
+    }
+    let n = neighborhood(blocks);
+    let greedy = greedy(&n);
+    let naive = naive(&n);
+    assert!(greedy.coord_count() < naive.coord_count());
+    assert_eq!(face_area(&naive), face_area(&greedy));
+    // Both keep each face direction in its own range.
+    assert_eq!(face_areas(&naive), face_areas(&greedy));
+    assert_eq!(naive.coord_count() as u32, 4 * naive.face_quads().iter().sum::<u32>());
+  }
+
+  /// Row masks show the same faces as looking up each block's neighbor, across chunk borders too.
+  #[test]
+  fn exposed_faces_match_block_lookups() {
+    let solid = |c: &Chunk, seed: i32| {
+      let bounds = c.block_bounds();
+      let mut blocks = ChunkBlocks::new(&bounds);
+      for y in bounds.min.y..bounds.max.y + 1 {
+        for z in bounds.min.z..bounds.max.z + 1 {
+          for x in bounds.min.x..bounds.max.x + 1 {
+            if (x * 7 + y * 13 + z * 5 + seed) % 3 == 0 || y < bounds.min.y + seed {
+              blocks.set(&Block::new(x, y, z), SOLID);
+            }
+          }
+        }
+      }
+      Arc::new(blocks)
+    };
+    let chunk = Chunk::new(0, 0, 0);
+    let neighbors = chunk.neighbors();
+    let n = Neighborhood {
+      blocks: solid(&chunk, 4),
+      neighbors: [Some(solid(&neighbors[0], 1)), None, Some(solid(&neighbors[2], 16)),
+        Some(solid(&neighbors[3], 2)), None, Some(solid(&neighbors[5], 0))],
+      chunk: chunk,
+    };
+    let exposed = ExposedFaces::new(&n);
+    for i in 0..6 {
+      for y in 0..CHUNK_SIZE {
+        for z in 0..CHUNK_SIZE {
+          for x in 0..CHUNK_SIZE {
+            let expected = n.blocks.contains_local(x, y, z) && face_visible(&n, i, x, y, z);
+            assert_eq!(expected, exposed.row(i, y, z) & 1 << x != 0, "face {} at {} {} {}",
+              i, x, y, z);
+          }
+        }
+      }
+    }
+  }
+
+  /// Quads of each face direction as sorted corner lists, to compare meshes ignoring quad order.
+  fn quads(vertices: &Vertices) -> Vec<Vec<Vec<([u8; 4], [u8; 4])>>> {
+    let mut start = 0;
+    vertices.face_quads().iter().map(|&n| {
+      let end = start + 4 * n as usize;
+      let mut quads: Vec<Vec<([u8; 4], [u8; 4])>> = vertices.coords()[start..end].chunks(4)
+        .map(|q| q.iter().map(|c| (c.xyz, c.st)).collect())
+        .collect();
+      quads.sort();
+      start = end;
+      quads
+    }).collect()
+  }
+
+  /// Patching the sides facing neighbors which arrived or left gives the full remesh.
+  #[test]
+  fn replaced_sides_match_full_mesh() {
+    let hills = |c: &Chunk| {
+      let bounds = c.block_bounds();
+      let mut blocks = ChunkBlocks::new(&bounds);
+      for z in bounds.min.z..bounds.max.z + 1 {
+        for x in bounds.min.x..bounds.max.x + 1 {
+          for y in bounds.min.y..bounds.min.y + 1 + ((x * 5 + z * 3) & 15) {
+            blocks.set(&Block::new(x, y, z), SOLID);
+          }
+        }
+      }
+      Arc::new(blocks)
+    };
+    let chunk = Chunk::new(0, 0, 0);
+    let ns = chunk.neighbors();
+    let mut n = Neighborhood {
+      blocks: hills(&chunk),
+      neighbors: [Some(hills(&ns[0])), None, None, None, None, None],
+      chunk: chunk,
+    };
+    let mut scratch = MeshScratch::new();
+    let vertices = create_mesh_vertices(&mut scratch, &n, 0);
+
+    // Left neighbor leaves, right and forward ones arrive.
+    n.neighbors[0] = None;
+    n.neighbors[1] = Some(hills(&ns[1]));
+    n.neighbors[4] = Some(hills(&ns[4]));
+    let sides = 1 << 0 | 1 << 1 | 1 << 4;
+    let vertices = vertices.with_sides(sides, &create_side_vertices(&n, sides));
+    let full = create_mesh_vertices(&mut scratch, &n, 0);
+    assert_eq!(quads(&full), quads(&vertices));
+  }
+
+  /// After an edit, the rearranged remesh differs from the old mesh in a few quads, and writing
+  /// just those over the old mesh gives the rearranged one.
+  #[test]
+  fn arranged_remesh_changes_few_quads() {
+    let bounds = Chunk::new(0, 0, 0).block_bounds();
+    let mut blocks = ChunkBlocks::new(&bounds);
+    for z in bounds.min.z..bounds.max.z + 1 {
+      for x in bounds.min.x..bounds.max.x + 1 {
+        for y in bounds.min.y..bounds.min.y + 1 + ((x * 5 + z * 3) & 7) {
+          blocks.set(&Block::new(x, y, z), SOLID);
+        }
+      }
+    }
+    let mut scratch = MeshScratch::new();
+    let old = create_mesh_vertices(&mut scratch, &neighborhood(blocks.clone()), 0);
+    blocks.set(&Block::new(0, bounds.min.y, 0), EMPTY);
+    blocks.set(&Block::new(3, bounds.max.y, -2), SOLID);
+    let new = create_mesh_vertices(&mut scratch, &neighborhood(blocks), 0);
+    let (new_quads, new_count) = (quads(&new), new.coord_count() / 4);
+    let (arranged, changed) = new.arrange_like(&old);
+    assert_eq!(new_quads, quads(&arranged));
+
+    let (mut start, mut old_start) = (0, 0);
+    for i in 0..6 {
+      let (nq, oq) = (arranged.face_quads()[i] as usize, old.face_quads()[i] as usize);
+      let mut face: Vec<&[Coords]> = old.coords()[old_start..old_start + 4 * oq].chunks(4)
+        .collect();
+      face.resize(nq, &[]);
+      for &(_, first, quads) in changed.iter().filter(|&&(f, _, _)| f == i) {
+        for q in first as usize..cmp::min(nq, (first + quads) as usize) {
+          face[q] = &arranged.coords()[start + 4 * q..start + 4 * q + 4];
+        }
+      }
+      face.truncate(nq);
+      assert_eq!(arranged.coords()[start..start + 4 * nq].chunks(4).collect::<Vec<_>>(), face);
+      start += 4 * nq;
+      old_start += 4 * oq;
+    }
+    let quads_changed: u32 = changed.iter().map(|&(_, _, quads)| quads).sum();
+    assert!(quads_changed <= 16, "{} of {} quads changed", quads_changed, new_count);
+  }
+
+  #[test]
+  fn facing_faces_of_chunk_beside_eye() {
+    let origin = [16.5, -0.5, -0.5];
+    // Left of the chunk at its mid height: its left faces may face the eye, right faces don't.
+    let eye = Point3::new(0.0, 8.0, 8.0);
+    assert_eq!([true, false, true, true, true, true], facing_faces(&origin, 17.0, &eye));
+    // Above and in front of it.
+    let eye = Point3::new(20.0, 30.0, -5.0);
+    assert_eq!([true, true, false, true, true, false], facing_faces(&origin, 17.0, &eye));
+  }
+
+  /// Shared indices address every vertex of the largest possible mesh with u16.
+  #[test]
+  fn quad_indices_cover_max_quads() {
+    let indices = quad_indices();
+    assert_eq!(6 * MAX_QUADS, indices.len());
+    assert_eq!(&[4, 5, 7, 7, 5, 6], &indices[6..12]);
+    assert!(4 * MAX_QUADS - 1 <= u16::MAX as usize);
+    assert_eq!((4 * MAX_QUADS - 1) as u16, *indices.iter().max().unwrap());
+  }
+
+  /// Coarse meshes of a lone pillar keep its full height and box in the blocks it leaves empty.
+  #[test]
+  fn coarse_mesh_encloses_blocks() {
+    let bounds = Chunk::new(0, 0, 0).block_bounds();
+    let mut blocks = ChunkBlocks::new(&bounds);
+    for y in bounds.min.y..bounds.min.y + 5 {
+      blocks.set(&Block::new(bounds.min.x + 1, y, bounds.min.z + 1), SOLID);
+    }
+    let n = neighborhood(blocks);
+    for lod in 1..3 {
+      let vertices = create_mesh_vertices(&mut MeshScratch::new(), &n, lod);
+      assert_eq!(lod, vertices.lod());
+      // One box merged from whole voxels.
+      assert_eq!(6 * 4, vertices.coord_count());
+      let size = 1 << lod;
+      let top = if lod == 1 { 6 } else { 8 };
+      for (axis, &extent) in [size, top, size].iter().enumerate() {
+        assert_eq!(0, vertices.coords().iter().map(|c| c.xyz[axis]).min().unwrap());
+        assert_eq!(extent, vertices.coords().iter().map(|c| c.xyz[axis]).max().unwrap());
+      }
+    }
+  }
+
+  /// The chunk's last voxel along each axis is cut short at CHUNK_SIZE blocks.
+  #[test]
+  fn coarse_mesh_of_full_chunk_fits_chunk() {
+    let bounds = Chunk::new(0, 0, 0).block_bounds();
+    let mut blocks = ChunkBlocks::new(&bounds);
+    for y in bounds.min.y..bounds.max.y + 1 {
+      for z in bounds.min.z..bounds.max.z + 1 {
+        for x in bounds.min.x..bounds.max.x + 1 {
+          blocks.set(&Block::new(x, y, z), SOLID);
+        }
+      }
+    }
+    let n = neighborhood(blocks);
+    let mut scratch = MeshScratch::new();
+    let full = create_mesh_vertices(&mut scratch, &n, 0);
+    for lod in 1..3 {
+      let coarse = create_mesh_vertices(&mut scratch, &n, lod);
+      assert_eq!(face_areas(&full), face_areas(&coarse));
+    }
+  }
+
+  /// Reused scratch buffers leave nothing behind from earlier chunks.
+  #[test]
+  fn scratch_reuse_matches_fresh_scratch() {
+    let bounds = Chunk::new(0, 0, 0).block_bounds();
+    let mut hill = ChunkBlocks::new(&bounds);
+    for z in bounds.min.z..bounds.max.z + 1 {
+      for x in bounds.min.x..bounds.max.x + 1 {
+        for y in bounds.min.y..bounds.min.y + 1 + ((x * 5 + z) & 7) {
+          hill.set(&Block::new(x, y, z), SOLID);
+        }
+      }
+    }
+    let mut pillar = ChunkBlocks::new(&bounds);
+    pillar.set(&Block::new(bounds.min.x + 3, bounds.min.y, bounds.min.z + 2), SOLID);
+    let (hill, pillar) = (neighborhood(hill), neighborhood(pillar));
+
+    let mut scratch = MeshScratch::new();
+    for lod in 0..3 {
+      create_mesh_vertices(&mut scratch, &hill, lod);
+      let reused = create_mesh_vertices(&mut scratch, &pillar, lod);
+      let fresh = create_mesh_vertices(&mut MeshScratch::new(), &pillar, lod);
+      let corners = |v: &Vertices| v.coords().iter().map(|c| (c.xyz, c.st)).collect::<Vec<_>>();
+      assert_eq!(corners(&fresh), corners(&reused));
+      assert_eq!(fresh.face_quads(), reused.face_quads());
+      assert_eq!(fresh.connectivity(), reused.connectivity());
+    }
+  }
+
+  #[test]
+  fn lod_bands() {
+    assert_eq!(0, lod_for_distance(0.0));
+    assert_eq!(0, lod_for_distance(super::LOD_DISTANCES[0]));
+    assert_eq!(1, lod_for_distance(super::LOD_DISTANCES[0] + 1.0));
+    assert_eq!(2, lod_for_distance(100.0));
+  }
+
+  /// Meshed chunks keep their level of detail until a block or so past a boundary.
+  #[test]
+  fn lod_bands_have_hysteresis() {
+    let d = super::LOD_DISTANCES;
+    assert_eq!(0, lod_for_distance_from(0, d[0] + 1.0));
+    assert_eq!(1, lod_for_distance_from(0, d[0] + 2.0));
+    assert_eq!(1, lod_for_distance_from(1, d[0] - 1.0));
+    assert_eq!(0, lod_for_distance_from(1, d[0] - 2.0));
+    assert_eq!(1, lod_for_distance_from(1, d[1] + 1.0));
+    assert_eq!(2, lod_for_distance_from(0, 100.0));
+    assert_eq!(0, lod_for_distance_from(2, 0.0));
+  }
+
+  #[test]
+  fn chunk_box_spans_chunk() {
+    let coords = chunk_box();
+    assert_eq!(6 * 4, coords.len());
+    let size = CHUNK_SIZE as u8;
+    // Every box face has 4 distinct corners on the chunk's sides.
+    for quad in coords.chunks(4) {
+      assert!(quad.iter().all(|c| c.xyz[..3].iter().all(|&x| x == 0 || x == size)));
+      let corners: ::std::collections::HashSet<[u8; 4]> = quad.iter().map(|c| c.xyz).collect();
+      assert_eq!(4, corners.len());
+    }
+  }
+}
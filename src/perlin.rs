@@ -1,52 +1,570 @@
-use std::ops::Range;
+//! Terrain generation from gradient noise.  The noise is noise-rs's perlin3 summed into a
+//! Brownian3 as the generator used before, with the same seed shuffle, evaluated a chunk row at a
+//! time.  Values match the per-block noise-rs path up to float rounding, within `TOLERANCE`; only
+//! blocks whose value lies that close to the height threshold may differ.
+
+use std::cmp::min;
+use std::collections::{HashMap, VecDeque};
+use std::mem;
+use std::sync::{Arc, Mutex};
+use std::usize;
 use time;
 
 use collision::Aabb3;
-use noise;
-use noise::{Brownian3, Seed};
 
-use world::Block;
+use world::{Block, CHUNK_SIZE, Chunk, ChunkBlocks, SOLID};
+
+/// How terrain gets generated.
+#[allow(dead_code)]
+#[derive(Clone, Copy, Debug, PartialEq)]
+pub enum Terrain {
+  /// 3D noise thresholded by height within the chunk, has overhangs and floating blocks.
+  Volume,
+  /// 2D noise gives a surface height per column, everything below it is solid.  Samples noise
+  /// once per column instead of once per block.
+  Heightmap,
+}
+
+pub const TERRAIN: Terrain = Terrain::Volume;
+
+/// Seed the permutation table is shuffled with.
+const SEED: u32 = 1;
+/// Fractal noise parameters: octave count, wavelength of the first octave, frequency multiplier
+/// and amplitude multiplier between octaves.
+const OCTAVES: usize = 4;
+const WAVELENGTH: f32 = 16.0;
+const LACUNARITY: f32 = 2.0;
+const PERSISTENCE: f32 = 0.5;
+
+/// Scales the sum of surflets into [-1; 1].
+const SCALE: f32 = 3.8891637;
+const SCALE_2D: f32 = 3.1604938;
+
+/// Largest difference from noise-rs's per-block Brownian3 accepted, from summing surflets in
+/// another order.
+#[cfg(test)]
+const TOLERANCE: f32 = 1e-6;
+
+/// Surface height for 2D noise value 1.0, keeps the surface within chunks at y = 0.
+const SURFACE_AMPLITUDE: f32 = ((CHUNK_SIZE - 1) / 2) as f32;
+
+/// Number of chunk column heightmaps kept around for chunks stacked above each other.
+const HEIGHTMAP_CACHE_SIZE: usize = 128;
+
+/// Chunk rows along z are evaluated together, one lane per block.
+const ROW: usize = CHUNK_SIZE as usize;
+
+/// Gradients towards cube edge midpoints.
+const GRADIENTS: [[f32; 3]; 12] = [
+  [DIAG, DIAG, 0.0], [DIAG, -DIAG, 0.0], [-DIAG, DIAG, 0.0], [-DIAG, -DIAG, 0.0],
+  [DIAG, 0.0, DIAG], [DIAG, 0.0, -DIAG], [-DIAG, 0.0, DIAG], [-DIAG, 0.0, -DIAG],
+  [0.0, DIAG, DIAG], [0.0, DIAG, -DIAG], [0.0, -DIAG, DIAG], [0.0, -DIAG, -DIAG],
+];
+const DIAG: f32 = 0.70710678;
+
+/// Gradients for 2D noise.
+const GRADIENTS_2D: [[f32; 2]; 8] = [
+  [1.0, 0.0], [-1.0, 0.0], [0.0, 1.0], [0.0, -1.0],
+  [DIAG, DIAG], [-DIAG, DIAG], [DIAG, -DIAG], [-DIAG, -DIAG],
+];
+
+/// Lookup tables, built once and shared by all threads.
+struct Tables {
+  /// Permutation of 0..255 to hash lattice coordinates with.
+  permutation: [u8; 256],
+  /// Gradient for each hash value.
+  gradients: [[f32; 3]; 256],
+  gradients_2d: [[f32; 2]; 256],
+}
+
+impl Tables {
+  fn new(seed: u32) -> Tables {
+    let mut permutation = [0u8; 256];
+    for (i, p) in permutation.iter_mut().enumerate() {
+      *p = i as u8;
+    }
+    // Shuffled like noise-rs's Seed::new: the rand crate's XorShiftRng seeded with
+    // [1, seed, seed, seed] drives its Rng::shuffle.
+    let mut rng = XorShift::new(seed);
+    let mut i = permutation.len();
+    while i >= 2 {
+      i -= 1;
+      let j = rng.below(i + 1);
+      permutation.swap(i, j);
+    }
+
+    let mut gradients = [[0.0; 3]; 256];
+    for (i, g) in gradients.iter_mut().enumerate() {
+      *g = GRADIENTS[i % GRADIENTS.len()];
+    }
+    let mut gradients_2d = [[0.0; 2]; 256];
+    for (i, g) in gradients_2d.iter_mut().enumerate() {
+      *g = GRADIENTS_2D[i % GRADIENTS_2D.len()];
+    }
+
+    Tables {
+      permutation: permutation,
+      gradients: gradients,
+      gradients_2d: gradients_2d,
+    }
+  }
+
+  #[inline(always)]
+  fn hash(&self, h: usize, coord: i32) -> usize {
+    self.permutation[h ^ (coord & 0xff) as usize] as usize
+  }
+}
 
-pub fn generate_blocks(boundaries: &Aabb3<i32>) -> Vec<Block> {
+/// The rand crate's xorshift generator, as noise-rs seeded it.
+struct XorShift {
+  state: [u32; 4],
+}
+
+impl XorShift {
+  fn new(seed: u32) -> XorShift {
+    XorShift {
+      state: [1, seed, seed, seed],
+    }
+  }
+
+  fn next_u32(&mut self) -> u32 {
+    let x = self.state[0];
+    let t = x ^ (x << 11);
+    self.state = [self.state[1], self.state[2], self.state[3], self.state[3]];
+    let w = self.state[3];
+    self.state[3] = w ^ (w >> 19) ^ (t ^ (t >> 8));
+    self.state[3]
+  }
+
+  /// Random usize, from one or two u32s depending on its width like `Rng::gen::<usize>`.
+  fn next_usize(&mut self) -> usize {
+    if mem::size_of::<usize>() == 8 {
+      let high = self.next_u32() as u64;
+      (high << 32 | self.next_u32() as u64) as usize
+    } else {
+      self.next_u32() as usize
+    }
+  }
+
+  /// Uniform in [0, n), rejecting samples from the incomplete last range like `Rng::gen_range`.
+  fn below(&mut self, n: usize) -> usize {
+    let zone = usize::MAX - usize::MAX % n;
+    loop {
+      let v = self.next_usize();
+      if v < zone {
+        return v % n;
+      }
+    }
+  }
+}
+
+/// Surface heights of a chunk column, indexed by local z * ROW + local x.
+struct Heightmap {
+  heights: [i32; ROW * ROW],
+}
+
+/// Recently used heightmaps by chunk column origin, oldest evicted first.
+struct HeightmapCache {
+  heightmaps: HashMap<(i32, i32), Arc<Heightmap>>,
+  order: VecDeque<(i32, i32)>,
+}
+
+lazy_static! {
+  static ref TABLES: Tables = Tables::new(SEED);
+  static ref HEIGHTMAPS: Mutex<HeightmapCache> = Mutex::new(HeightmapCache {
+    heightmaps: HashMap::new(),
+    order: VecDeque::new(),
+  });
+}
+
+pub fn generate_blocks(boundaries: &Aabb3<i32>) -> ChunkBlocks {
   let start_s = time::precise_time_s();
 
-  let seed = Seed::new(1);
-  let noise = Brownian3::new(noise::perlin3, 4).wavelength(16.0);
+  let mut blocks = ChunkBlocks::new(boundaries);
+  match TERRAIN {
+    Terrain::Volume => generate_volume(boundaries, &mut blocks),
+    Terrain::Heightmap => generate_heightmap(boundaries, &mut blocks),
+  }
 
-  let x_range = Range {
-    start: boundaries.min.x,
-    end: boundaries.max.x + 1,
-  };
-  let y_range = Range {
-    start: boundaries.min.y,
-    end: boundaries.max.y + 1,
-  };
-  let z_range = Range {
-    start: boundaries.min.z,
-    end: boundaries.max.z + 1,
-  };
-  let y_scale = 1.0 / (y_range.end as f32 - 1.0 - y_range.start as f32);
-  let y_min = y_range.start as f32;
+  let spent_ms = (time::precise_time_s() - start_s) * 1000.0;
+  log!("*** Generated a chunk of perlin: {:.3}ms, {} blocks", spent_ms, blocks.len());
 
-  let mut blocks = Vec::new();
-  for y in y_range {
+  blocks
+}
+
+/// Height of the terrain surface at (x, z), if it is known without looking at blocks.
+pub fn surface_height(x: i32, z: i32) -> Option<i32> {
+  match TERRAIN {
+    Terrain::Volume => None,
+    Terrain::Heightmap => {
+      let bounds = Chunk::of_block(&Block::new(x, 0, z)).block_bounds();
+      let heightmap = heightmap(bounds.min.x, bounds.min.z);
+      let (local_x, local_z) = ((x - bounds.min.x) as usize, (z - bounds.min.z) as usize);
+      Some(heightmap.heights[local_z * ROW + local_x])
+    },
+  }
+}
+
+fn generate_volume(boundaries: &Aabb3<i32>, blocks: &mut ChunkBlocks) {
+  let y_min = boundaries.min.y as f32;
+  let y_scale = 1.0 / (boundaries.max.y - boundaries.min.y) as f32;
+  let mut zs = [0.0; ROW];
+  for (i, z) in zs.iter_mut().enumerate() {
+    *z = (boundaries.min.z + i as i32) as f32;
+  }
+
+  let mut row = [0.0; ROW];
+  for y in boundaries.min.y..boundaries.max.y + 1 {
     // Normalize into [0, 1].
     let normalized_y = (y as f32 - y_min) * y_scale;
-    for x in x_range.clone() {
-      for z in z_range.clone() {
-        let p = [x as f32, y as f32, z as f32];
-        let val = noise.apply(&seed, &p);
-
+    for x in boundaries.min.x..boundaries.max.x + 1 {
+      fractal_row(&TABLES, x as f32, y as f32, &zs, &mut row);
+      for (i, val) in row.iter().enumerate() {
         // Probablility to have a block added linearly increases from 0.0 at y_max to 1.0 at y_min.
         if 0.5 * (val + 1.0) >= normalized_y {
-          blocks.push(Block::new(x, y, z));
+          blocks.set(&Block::new(x, y, boundaries.min.z + i as i32), SOLID);
         }
       }
     }
   }
+}
 
-  let spent_ms = (time::precise_time_s() - start_s) * 1000.0;
-  log!("*** Generated a chunk of perlin: {:.3}ms, {} blocks", spent_ms, blocks.len());
+fn generate_heightmap(boundaries: &Aabb3<i32>, blocks: &mut ChunkBlocks) {
+  let heightmap = heightmap(boundaries.min.x, boundaries.min.z);
+  for local_z in 0..ROW {
+    let z = boundaries.min.z + local_z as i32;
+    for local_x in 0..ROW {
+      let x = boundaries.min.x + local_x as i32;
+      let top = min(heightmap.heights[local_z * ROW + local_x], boundaries.max.y);
+      for y in boundaries.min.y..top + 1 {
+        blocks.set(&Block::new(x, y, z), SOLID);
+      }
+    }
+  }
+}
 
-  blocks
+/// Heightmap for the chunk column with minimum corner (min_x, min_z), cached so that chunks
+/// stacked above each other only sample noise once.
+fn heightmap(min_x: i32, min_z: i32) -> Arc<Heightmap> {
+  let key = (min_x, min_z);
+  if let Some(h) = HEIGHTMAPS.lock().unwrap().heightmaps.get(&key) {
+    return h.clone();
+  }
+
+  // Computed without holding the lock, another thread may race to compute the same one.
+  let mut heightmap = Heightmap {
+    heights: [0; ROW * ROW],
+  };
+  let mut xs = [0.0; ROW];
+  for (i, x) in xs.iter_mut().enumerate() {
+    *x = (min_x + i as i32) as f32;
+  }
+  let mut row = [0.0; ROW];
+  for local_z in 0..ROW {
+    fractal_row_2d(&TABLES, &xs, (min_z + local_z as i32) as f32, &mut row);
+    for local_x in 0..ROW {
+      let height = SURFACE_AMPLITUDE * row[local_x].max(-1.0).min(1.0);
+      heightmap.heights[local_z * ROW + local_x] = height.floor() as i32;
+    }
+  }
+  let heightmap = Arc::new(heightmap);
+
+  let mut cache = HEIGHTMAPS.lock().unwrap();
+  if !cache.heightmaps.contains_key(&key) {
+    if cache.order.len() >= HEIGHTMAP_CACHE_SIZE {
+      if let Some(oldest) = cache.order.pop_front() {
+        cache.heightmaps.remove(&oldest);
+      }
+    }
+    cache.order.push_back(key);
+    cache.heightmaps.insert(key, heightmap.clone());
+  }
+  heightmap
+}
+
+/// Fractal Brownian motion over gradient noise for a row of points (x, y, zs[i]).
+fn fractal_row(tables: &Tables, x: f32, y: f32, zs: &[f32; ROW], out: &mut [f32; ROW]) {
+  let mut frequency = 1.0 / WAVELENGTH;
+  let mut amplitude = 1.0;
+  let mut scaled_zs = [0.0; ROW];
+  let mut octave = [0.0; ROW];
+  *out = [0.0; ROW];
+  for _ in 0..OCTAVES {
+    for i in 0..ROW {
+      scaled_zs[i] = zs[i] * frequency;
+    }
+    noise_row(tables, x * frequency, y * frequency, &scaled_zs, &mut octave);
+    for i in 0..ROW {
+      out[i] += octave[i] * amplitude;
+    }
+    amplitude *= PERSISTENCE;
+    frequency *= LACUNARITY;
+  }
+}
+
+/// Fractal Brownian motion over 2D gradient noise for a row of points (xs[i], z).
+fn fractal_row_2d(tables: &Tables, xs: &[f32; ROW], z: f32, out: &mut [f32; ROW]) {
+  let mut frequency = 1.0 / WAVELENGTH;
+  let mut amplitude = 1.0;
+  let mut scaled_xs = [0.0; ROW];
+  let mut octave = [0.0; ROW];
+  *out = [0.0; ROW];
+  for _ in 0..OCTAVES {
+    for i in 0..ROW {
+      scaled_xs[i] = xs[i] * frequency;
+    }
+    noise_row_2d(tables, &scaled_xs, z * frequency, &mut octave);
+    for i in 0..ROW {
+      out[i] += octave[i] * amplitude;
+    }
+    amplitude *= PERSISTENCE;
+    frequency *= LACUNARITY;
+  }
+}
+
+/// 2D gradient noise in [-1; 1] for a row of points (xs[i], z), see `noise_row`.
+fn noise_row_2d(tables: &Tables, xs: &[f32; ROW], z: f32, out: &mut [f32; ROW]) {
+  let z_floor = z.floor();
+  let iz = z_floor as i32;
+  let dzs = [z - z_floor, z - z_floor - 1.0];
+
+  let mut ixs = [0i32; ROW];
+  let mut dxs = [[0.0f32; ROW]; 2];
+  for i in 0..ROW {
+    let x_floor = xs[i].floor();
+    ixs[i] = x_floor as i32;
+    dxs[0][i] = xs[i] - x_floor;
+    dxs[1][i] = xs[i] - x_floor - 1.0;
+  }
+
+  let mut sum = [0.0f32; ROW];
+  for a in 0..2 {
+    let dx = &dxs[a];
+    for c in 0..2 {
+      let dz = dzs[c];
+      for i in 0..ROW {
+        let h = tables.hash(0, ixs[i] + a as i32);
+        let g = &tables.gradients_2d[tables.hash(h, iz + c as i32)];
+        let attn = (1.0 - dx[i] * dx[i] - dz * dz).max(0.0);
+        let attn2 = attn * attn;
+        sum[i] += attn2 * attn2 * (dx[i] * g[0] + dz * g[1]);
+      }
+    }
+  }
+
+  for i in 0..ROW {
+    out[i] = (sum[i] * SCALE_2D).max(-1.0).min(1.0);
+  }
+}
+
+/// Gradient noise in [-1; 1] for a row of points (x, y, zs[i]).
+///
+/// Each lattice corner contributes a surflet (1 - d²)⁴ (d · g) if it is within distance 1.  x and
+/// y are shared by the whole row, so the x/y part of corner hashes and distances is computed once
+/// per row, lanes only differ in z.  Lane loops are branch free so they vectorize.
+fn noise_row(tables: &Tables, x: f32, y: f32, zs: &[f32; ROW], out: &mut [f32; ROW]) {
+  let x_floor = x.floor();
+  let y_floor = y.floor();
+  let (ix, iy) = (x_floor as i32, y_floor as i32);
+  let dxs = [x - x_floor, x - x_floor - 1.0];
+  let dys = [y - y_floor, y - y_floor - 1.0];
+  // Hashes of the 4 (x, y) corner columns, indexed by 2 * a + b for corner (ix + a, iy + b).
+  let mut column_hashes = [0; 4];
+  for a in 0..2 {
+    for b in 0..2 {
+      let h = tables.hash(0, ix + a as i32);
+      column_hashes[2 * a + b] = tables.hash(h, iy + b as i32);
+    }
+  }
+
+  let mut izs = [0i32; ROW];
+  let mut dzs = [[0.0f32; ROW]; 2];
+  for i in 0..ROW {
+    let z_floor = zs[i].floor();
+    izs[i] = z_floor as i32;
+    dzs[0][i] = zs[i] - z_floor;
+    dzs[1][i] = zs[i] - z_floor - 1.0;
+  }
+
+  let mut sum = [0.0f32; ROW];
+  for a in 0..2 {
+    for b in 0..2 {
+      let (dx, dy) = (dxs[a], dys[b]);
+      let dxy_squared = dx * dx + dy * dy;
+      let column_hash = column_hashes[2 * a + b];
+      for c in 0..2 {
+        let dz = &dzs[c];
+        for i in 0..ROW {
+          let g = &tables.gradients[tables.hash(column_hash, izs[i] + c as i32)];
+          let attn = (1.0 - dxy_squared - dz[i] * dz[i]).max(0.0);
+          let attn2 = attn * attn;
+          sum[i] += attn2 * attn2 * (dx * g[0] + dy * g[1] + dz[i] * g[2]);
+        }
+      }
+    }
+  }
+
+  for i in 0..ROW {
+    out[i] = (sum[i] * SCALE).max(-1.0).min(1.0);
+  }
+}
+
+#[cfg(test)]
+mod tests {
+  use collision::Aabb3;
+  use world::{Block, Chunk};
+  use super::{GRADIENTS, LACUNARITY, OCTAVES, PERSISTENCE, ROW, SCALE, SEED, TOLERANCE, Tables,
+    WAVELENGTH, XorShift, fractal_row, generate_heightmap, heightmap, noise_row};
+  use world::ChunkBlocks;
+
+  /// Gradient noise vanishes at lattice points.
+  #[test]
+  fn noise_row_zero_at_lattice_points() {
+    let tables = Tables::new(SEED);
+    let mut zs = [0.0; ROW];
+    for (i, z) in zs.iter_mut().enumerate() {
+      *z = i as f32 - 8.0;
+    }
+    let mut out = [1.0; ROW];
+    noise_row(&tables, 3.0, -5.0, &zs, &mut out);
+    assert!(out.iter().all(|&v| v == 0.0));
+  }
+
+  /// A lane does not depend on the rest of the row.
+  #[test]
+  fn noise_row_lanes_independent() {
+    let tables = Tables::new(SEED);
+    let mut zs = [0.0; ROW];
+    for (i, z) in zs.iter_mut().enumerate() {
+      *z = 0.37 * i as f32 - 2.9;
+    }
+    let mut row = [0.0; ROW];
+    fractal_row(&tables, 1.3, 7.7, &zs, &mut row);
+    for i in 0..ROW {
+      let single = [zs[i]; ROW];
+      let mut out = [0.0; ROW];
+      fractal_row(&tables, 1.3, 7.7, &single, &mut out);
+      assert_eq!(out[0], row[i]);
+    }
+  }
+
+  #[test]
+  fn fractal_row_in_range() {
+    let tables = Tables::new(SEED);
+    let mut zs = [0.0; ROW];
+    for (i, z) in zs.iter_mut().enumerate() {
+      *z = 1.1 * i as f32;
+    }
+    let mut row = [0.0; ROW];
+    let mut nonzero = 0;
+    for x in -20..20 {
+      fractal_row(&tables, x as f32 * 0.9, 3.3, &zs, &mut row);
+      assert!(row.iter().all(|v| v.abs() <= 1.875));
+      nonzero += row.iter().filter(|&&v| v != 0.0).count();
+    }
+    assert!(nonzero > 0);
+  }
+
+  /// noise-rs's perlin3 at one point as the per-block generator called it, corners summed in its
+  /// order.
+  fn reference_perlin3(tables: &Tables, p: [f32; 3]) -> f32 {
+    let floor = [p[0].floor(), p[1].floor(), p[2].floor()];
+    let mut sum = 0.0;
+    for corner in 0..8 {
+      let offset = [corner & 1, corner >> 1 & 1, corner >> 2 & 1];
+      let whole: Vec<i32> = (0..3).map(|i| floor[i] as i32 + offset[i]).collect();
+      let frac: Vec<f32> = (0..3).map(|i| p[i] - floor[i] - offset[i] as f32).collect();
+      let attn = 1.0 - frac[0] * frac[0] - frac[1] * frac[1] - frac[2] * frac[2];
+      if attn > 0.0 {
+        let h = tables.hash(tables.hash(tables.hash(0, whole[0]), whole[1]), whole[2]);
+        let g = GRADIENTS[h % 12];
+        sum += (attn * attn) * (attn * attn) * (frac[0] * g[0] + frac[1] * g[1] + frac[2] * g[2]);
+      }
+    }
+    (sum * SCALE).max(-1.0).min(1.0)
+  }
+
+  /// noise-rs's Brownian3 over perlin3 with the generator's parameters.
+  fn reference_brownian3(tables: &Tables, p: [f32; 3]) -> f32 {
+    let (mut frequency, mut amplitude, mut result) = (1.0 / WAVELENGTH, 1.0, 0.0);
+    for _ in 0..OCTAVES {
+      result += reference_perlin3(tables, [p[0] * frequency, p[1] * frequency, p[2] * frequency]) *
+        amplitude;
+      amplitude *= PERSISTENCE;
+      frequency *= LACUNARITY;
+    }
+    result
+  }
+
+  /// The row kernel gives the per-block noise-rs values up to float rounding.
+  #[test]
+  fn fractal_row_matches_noise_rs() {
+    let tables = Tables::new(SEED);
+    let mut zs = [0.0; ROW];
+    let mut row = [0.0; ROW];
+    let mut worst = 0.0f32;
+    for &z_min in [-25, 8, 300].iter() {
+      for (i, z) in zs.iter_mut().enumerate() {
+        *z = (z_min + i as i32) as f32;
+      }
+      for y in -8..9 {
+        for x in -40..40 {
+          fractal_row(&tables, x as f32, y as f32, &zs, &mut row);
+          for i in 0..ROW {
+            let expected = reference_brownian3(&tables, [x as f32, y as f32, zs[i]]);
+            worst = worst.max((row[i] - expected).abs());
+          }
+        }
+      }
+    }
+    assert!(worst <= TOLERANCE, "{}", worst);
+  }
+
+  /// The shuffle's generator is Marsaglia's xor128, as in the rand crate noise-rs seeded.
+  #[test]
+  fn xorshift_matches_xor128() {
+    let mut rng = XorShift {
+      state: [123456789, 362436069, 521288629, 88675123],
+    };
+    let outputs: Vec<u32> = (0..4).map(|_| rng.next_u32()).collect();
+    assert_eq!(vec![3701687786, 458299110, 2500872618, 3633119408], outputs);
+  }
+
+  #[test]
+  fn permutation_is_a_permutation() {
+    let tables = Tables::new(SEED);
+    let mut seen = [false; 256];
+    for &p in tables.permutation.iter() {
+      seen[p as usize] = true;
+    }
+    assert!(seen.iter().all(|&s| s));
+  }
+
+  /// Stacked chunks share a heightmap, every column is solid exactly up to its surface.
+  #[test]
+  fn heightmap_columns_filled_to_surface() {
+    let chunk = Chunk::new(2, 0, -1);
+    let bounds = chunk.block_bounds();
+    let above = Aabb3 {
+      min: Block::new(bounds.min.x, bounds.max.y + 1, bounds.min.z),
+      max: Block::new(bounds.max.x, bounds.max.y + ROW as i32, bounds.max.z),
+    };
+    let mut blocks = ChunkBlocks::new(&bounds);
+    generate_heightmap(&bounds, &mut blocks);
+    let mut blocks_above = ChunkBlocks::new(&above);
+    generate_heightmap(&above, &mut blocks_above);
+
+    let heights = heightmap(bounds.min.x, bounds.min.z);
+    for z in 0..ROW {
+      for x in 0..ROW {
+        let surface = heights.heights[z * ROW + x];
+        let (bx, bz) = (bounds.min.x + x as i32, bounds.min.z + z as i32);
+        for y in bounds.min.y..above.max.y + 1 {
+          let b = Block::new(bx, y, bz);
+          let solid = blocks.contains(&b) || blocks_above.contains(&b);
+          assert_eq!(solid, y <= surface);
+        }
+      }
+    }
+  }
 }
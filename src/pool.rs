@@ -0,0 +1,298 @@
+use std::cmp;
+
+use gl;
+use gl::Buffer;
+use mesh::{Coords, MAX_QUADS, Vertices};
+
+/// Vertices per pooled buffer, 2MB with 8 byte vertices.  Always fits the largest chunk mesh.
+const PAGE_VERTICES: u32 = 1 << 18;
+
+/// Quads of room each face direction of a mesh gets on top of an eighth of its quads.
+const ROOM_QUADS: u32 = 4;
+
+/// First fit allocator of ranges within [0, capacity).  Freed ranges merge with free neighbors.
+pub struct Suballocator {
+  /// Free ranges as (start, length), sorted by start, never adjacent.
+  free: Vec<(u32, u32)>,
+}
+
+impl Suballocator {
+  pub fn new(capacity: u32) -> Suballocator {
+    Suballocator {
+      free: vec![(0, capacity)],
+    }
+  }
+
+  /// Start of a newly allocated range, `None` if no free range is long enough.
+  pub fn alloc(&mut self, len: u32) -> Option<u32> {
+    let i = match self.free.iter().position(|&(_, free_len)| free_len >= len) {
+      Some(i) => i,
+      None => return None,
+    };
+    let (start, free_len) = self.free[i];
+    if free_len == len {
+      self.free.remove(i);
+    } else {
+      self.free[i] = (start + len, free_len - len);
+    }
+    Some(start)
+  }
+
+  pub fn free(&mut self, start: u32, len: u32) {
+    let i = self.free.iter().position(|&(s, _)| s > start).unwrap_or(self.free.len());
+    let merges_prev = i > 0 && {
+      let (s, l) = self.free[i - 1];
+      s + l == start
+    };
+    let merges_next = i < self.free.len() && start + len == self.free[i].0;
+    match (merges_prev, merges_next) {
+      (true, true) => {
+        let (_, next_len) = self.free.remove(i);
+        self.free[i - 1].1 += len + next_len;
+      },
+      (true, false) => self.free[i - 1].1 += len,
+      (false, true) => self.free[i] = (start, len + self.free[i].1),
+      (false, false) => self.free.insert(i, (start, len)),
+    }
+  }
+
+  /// Total length of free ranges.
+  #[allow(dead_code)]
+  pub fn free_len(&self) -> u32 {
+    self.free.iter().map(|&(_, l)| l).sum()
+  }
+}
+
+/// Where a mesh's face directions sit within its range, each followed by room to grow, so a
+/// remesh rewrites the quads that changed in place, see `Vertices::arrange_like`.  Room not taken
+/// by quads holds degenerate ones, so runs of face directions still draw in one call.
+#[derive(Clone, Copy, Debug, PartialEq)]
+pub struct FaceLayout {
+  /// First quad of each face direction.
+  starts: [u32; 6],
+  /// Quads each face direction has room for.
+  capacities: [u32; 6],
+}
+
+impl FaceLayout {
+  /// Room for just the given quads of each face direction.
+  pub fn tight(face_quads: &[u32; 6]) -> FaceLayout {
+    FaceLayout::with_capacities(*face_quads)
+  }
+
+  /// Room for an eighth more quads plus `ROOM_QUADS` in each face direction, or just the quads
+  /// if that would not fit the shared indices.  Empty meshes get no room.
+  pub fn roomy(face_quads: &[u32; 6]) -> FaceLayout {
+    let mut capacities = *face_quads;
+    for c in capacities.iter_mut() {
+      *c += *c / 8 + ROOM_QUADS;
+    }
+    let quads: u32 = capacities.iter().sum();
+    if face_quads.iter().all(|&q| q == 0) || quads as usize > MAX_QUADS {
+      return FaceLayout::tight(face_quads);
+    }
+    FaceLayout::with_capacities(capacities)
+  }
+
+  fn with_capacities(capacities: [u32; 6]) -> FaceLayout {
+    let mut starts = [0; 6];
+    for i in 1..6 {
+      starts[i] = starts[i - 1] + capacities[i - 1];
+    }
+    FaceLayout {
+      starts: starts,
+      capacities: capacities,
+    }
+  }
+
+  /// Quads of the whole layout.
+  pub fn quads(&self) -> u32 {
+    self.starts[5] + self.capacities[5]
+  }
+
+  /// First quad of face direction i.
+  pub fn start(&self, i: usize) -> u32 {
+    self.starts[i]
+  }
+
+  /// Whether each face direction has room for the given quads.
+  pub fn fits(&self, face_quads: &[u32; 6]) -> bool {
+    face_quads.iter().zip(self.capacities.iter()).all(|(q, c)| q <= c)
+  }
+
+  /// Vertices of quads [first, first + quads) of vertices laid out in this layout.
+  pub fn coords(&self, vertices: &Vertices, first: u32, quads: u32) -> Vec<Coords> {
+    let face_quads = vertices.face_quads();
+    let mut coords = Vec::with_capacity(4 * quads as usize);
+    let mut face_start = 0;
+    for i in 0..6 {
+      let begin = cmp::max(first, self.starts[i]);
+      let end = cmp::min(first + quads, self.starts[i] + self.capacities[i]);
+      for q in begin..cmp::max(begin, end) {
+        let local = q - self.starts[i];
+        if local < face_quads[i] {
+          let v = 4 * (face_start + local) as usize;
+          coords.extend_from_slice(&vertices.coords()[v..v + 4]);
+        } else {
+          coords.extend((0..4).map(|_| Coords::degenerate()));
+        }
+      }
+      face_start += face_quads[i];
+    }
+    coords
+  }
+}
+
+/// A chunk mesh's vertices within one of the pool's buffers.
+pub struct Range {
+  pub buffer: Buffer,
+  page: usize,
+  /// First vertex.
+  pub start: u32,
+  len: u32,
+}
+
+struct Page {
+  buffer: Buffer,
+  vertices: Suballocator,
+}
+
+/// Chunk vertices suballocated from a few large GL array buffers, so loading and unloading chunks
+/// does not create and delete GL buffers, and consecutive chunks share a bound buffer.
+pub struct VertexPool {
+  pages: Vec<Page>,
+}
+
+impl Drop for VertexPool {
+  fn drop(&mut self) {
+    let buffers: Vec<Buffer> = self.pages.iter().map(|p| p.buffer).collect();
+    gl::delete_buffers(&buffers);
+  }
+}
+
+impl VertexPool {
+  pub fn new() -> VertexPool {
+    assert!(4 * MAX_QUADS as u32 <= PAGE_VERTICES);
+    VertexPool {
+      pages: Vec::new(),
+    }
+  }
+
+  /// Copies vertices into a free range, adding a buffer if none has room.  Leaves the range's
+  /// buffer bound as the array buffer.
+  pub fn upload(&mut self, coords: &[Coords]) -> Range {
+    let len = coords.len() as u32;
+    let found = self.pages.iter_mut().enumerate()
+      .filter_map(|(i, p)| p.vertices.alloc(len).map(|start| (i, start)))
+      .next();
+    let (page, start) = match found {
+      Some(found) => found,
+      None => {
+        self.add_page();
+        let page = self.pages.len() - 1;
+        (page, self.pages[page].vertices.alloc(len).unwrap())
+      },
+    };
+
+    let buffer = self.pages[page].buffer;
+    gl::bind_array_buffer(buffer);
+    gl::array_buffer_sub_data_coords(start * Coords::size_bytes(), coords);
+    Range {
+      buffer: buffer,
+      page: page,
+      start: start,
+      len: len,
+    }
+  }
+
+  /// Overwrites vertices of a range from its vertex first on.  Leaves the range's buffer bound as
+  /// the array buffer.
+  pub fn write(&self, range: &Range, first: u32, coords: &[Coords]) {
+    assert!(first + coords.len() as u32 <= range.len);
+    gl::bind_array_buffer(range.buffer);
+    gl::array_buffer_sub_data_coords((range.start + first) * Coords::size_bytes(), coords);
+  }
+
+  /// Returns a range for reuse by later uploads.
+  pub fn release(&mut self, range: Range) {
+    if range.len > 0 {
+      self.pages[range.page].vertices.free(range.start, range.len);
+    }
+  }
+
+  fn add_page(&mut self) {
+    let buffer = gl::generate_buffers(1)[0];
+    gl::bind_array_buffer(buffer);
+    gl::array_buffer_reserve(PAGE_VERTICES * Coords::size_bytes());
+    gl::unbind_array_buffer();
+    log!("*** Added vertex pool buffer {}: {} bytes", buffer, PAGE_VERTICES * Coords::size_bytes());
+    self.pages.push(Page {
+      buffer: buffer,
+      vertices: Suballocator::new(PAGE_VERTICES),
+    });
+  }
+}
+
+#[cfg(test)]
+mod tests {
+  use mesh::{Coords, Vertices, chunk_box};
+  use world::Block;
+  use super::{FaceLayout, Suballocator};
+
+  /// Each face direction gets room after its quads, filled with degenerate quads.
+  #[test]
+  fn face_layout_pads_room() {
+    let faces = chunk_box();
+    let quad = |i: usize| [faces[4 * i].clone(), faces[4 * i + 1].clone(),
+      faces[4 * i + 2].clone(), faces[4 * i + 3].clone()];
+    let mut vertices = Vertices::new(&Block::new(0, 0, 0), 0);
+    for _ in 0..16 {
+      vertices.add(1, &quad(1));
+    }
+    vertices.add(3, &quad(3));
+    let layout = FaceLayout::roomy(&vertices.face_quads());
+    assert_eq!([0, 4, 26, 30, 35, 39], layout.starts);
+    assert_eq!(43, layout.quads());
+    assert!(layout.fits(&[4, 22, 0, 5, 4, 4]));
+    assert!(!layout.fits(&[0, 23, 0, 0, 0, 0]));
+
+    let coords = layout.coords(&vertices, 0, layout.quads());
+    assert_eq!(4 * 43, coords.len());
+    assert_eq!(&quad(1)[..], &coords[4 * 4..4 * 5]);
+    assert_eq!(&quad(3)[..], &coords[4 * 30..4 * 31]);
+    assert!(coords[..4 * 4].iter().chain(coords[4 * 20..4 * 30].iter())
+      .all(|c| *c == Coords::degenerate()));
+    assert_eq!(&coords[4 * 29..4 * 31], &layout.coords(&vertices, 29, 2)[..]);
+    assert_eq!(0, FaceLayout::roomy(&[0; 6]).quads());
+  }
+
+  #[test]
+  fn suballocator_first_fit() {
+    let mut s = Suballocator::new(100);
+    assert_eq!(Some(0), s.alloc(30));
+    assert_eq!(Some(30), s.alloc(30));
+    assert_eq!(Some(60), s.alloc(30));
+    assert_eq!(None, s.alloc(20));
+    s.free(0, 30);
+    assert_eq!(None, s.alloc(31));
+    // The freed hole comes first, the tail after it fills.
+    assert_eq!(Some(0), s.alloc(10));
+    assert_eq!(Some(10), s.alloc(20));
+    assert_eq!(Some(90), s.alloc(10));
+    assert_eq!(0, s.free_len());
+  }
+
+  #[test]
+  fn suballocator_merges_freed_neighbors() {
+    let mut s = Suballocator::new(90);
+    let a = s.alloc(30).unwrap();
+    let b = s.alloc(30).unwrap();
+    let c = s.alloc(30).unwrap();
+    s.free(a, 30);
+    s.free(c, 30);
+    assert_eq!(None, s.alloc(60));
+    // Joins both free neighbors into one range.
+    s.free(b, 30);
+    assert_eq!(Some(0), s.alloc(90));
+  }
+}
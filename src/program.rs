@@ -1,10 +1,18 @@
 use std::{error, fmt};
+use std::cell::{Cell, RefCell};
 
-use cgmath::Matrix4;
+use cgmath::{Matrix4, Point3};
 
 use gl;
-use gl::{AttribLoc, Buffer, Enum, UnifLoc};
+use gl::{AttribLoc, Buffer, Enum, Query, QueryFns, UnifLoc, VertexArrayFns, VertexArrayObject};
+use mesh;
 use mesh::{Coords, Vertices};
+use pool::{FaceLayout, Range, VertexPool};
+use world::CHUNK_SIZE;
+
+/// Occlusion query results from queries issued more than this many frames earlier are not trusted
+/// to hide a chunk, the view may have changed too much since.
+const STALE_QUERY_FRAMES: u32 = 3;
 
 pub struct VertexArray {
   pub components: u32,
@@ -12,24 +20,28 @@ pub struct VertexArray {
 }
 
 pub struct Buffers {
-  pub vertex_buffer: Buffer,
+  /// World position of the chunk's local corner (0, 0, 0).
+  origin: [f32; 3],
+  /// Vertices within the program's vertex pool.
+  range: Range,
   position_coord_components: i32,
   position_coord_stride: i32,
   position_coord_offset: u32,
   texture_coord_components: i32,
   texture_coord_stride: i32,
   texture_coord_offset: u32,
-  pub index_buffer: Buffer,
-  pub index_count: i32,
-}
-
-impl Drop for Buffers {
-  fn drop(&mut self) {
-    // Debug.
-    log!("*** Deleting buffers: {}, {}", self.vertex_buffer, self.index_buffer);
-
-    gl::delete_buffers(&[self.vertex_buffer, self.index_buffer]);
-  }
+  /// Blocks along each axis the mesh spans from origin.
+  extent: f32,
+  /// Quads of each face direction, laid out in the range by layout.
+  face_quads: [u32; 6],
+  layout: FaceLayout,
+  /// Attribute arrays and buffer bindings captured once at upload, if supported.
+  vertex_array: Option<VertexArrayObject>,
+  /// Occlusion query last issued for the chunk's box and the frame it was issued in.
+  query: Cell<Option<Query>>,
+  queried_frame: Cell<u32>,
+  /// Whether the last occlusion query result said no part of the chunk's box was visible.
+  hidden: Cell<bool>,
 }
 
 pub struct Program {
@@ -37,13 +49,33 @@ pub struct Program {
   vertex_shader: Shader,
   fragment_shader: Shader,
   mvp_matrix: UnifLoc,
+  chunk_origin: UnifLoc,
   position: AttribLoc,
   texture_unit: UnifLoc,
   texture_coord: AttribLoc,
+  /// Index buffer shared by all chunk meshes.
+  quad_indices: Buffer,
+  vertex_arrays: Option<VertexArrayFns>,
+  /// Vertex buffers shared by all chunk meshes.
+  pool: RefCell<VertexPool>,
+  /// Array buffer bound by `bind_buffers` without vertex array objects, 0 if none.
+  bound_buffer: Cell<Buffer>,
+  /// Quads of a chunk sized box drawn in occlusion queries, and its attribute arrays if supported.
+  chunk_box: Buffer,
+  chunk_box_vertex_array: Option<VertexArrayObject>,
+  queries: Option<QueryFns>,
+  /// Queries of released chunks, for reuse.
+  free_queries: RefCell<Vec<Query>>,
+  /// Counts calls of `query_occlusion`.
+  frame: Cell<u32>,
 }
 
 impl Drop for Program {
   fn drop(&mut self) {
+    if let Some(ref queries) = self.queries {
+      queries.delete(&self.free_queries.borrow());
+    }
+    gl::delete_buffers(&[self.quad_indices, self.chunk_box]);
     gl::disable_vertex_attrib_array(self.position);
     gl::disable_vertex_attrib_array(self.texture_coord);
     gl::detach_shader(self.id, self.vertex_shader.id);
@@ -88,6 +120,10 @@ impl Program {
       Ok(l) => l,
       Err(e) => return Err(GlError::NotSupported(format!("gl::get_uniform_location(\"u_MVPMatrix\") failed: {:?}", e))),
     };
+    let chunk_origin = match gl::get_uniform_location(id, "u_ChunkOrigin") {
+      Ok(l) => l,
+      Err(e) => return Err(GlError::NotSupported(format!("gl::get_uniform_location(\"u_ChunkOrigin\") failed: {:?}", e))),
+    };
     let position = match gl::get_attrib_location(id, "a_Position") {
       Ok(l) => l,
       Err(e) => return Err(GlError::NotSupported(format!("gl::get_attrib_location(\"a_Position\") failed: {:?}", e))),
@@ -102,76 +138,285 @@ impl Program {
     };
     gl::use_program(id);
 
+    let quad_indices = gl::generate_buffers(1)[0];
+    gl::bind_index_buffer(quad_indices);
+    gl::index_buffer_data_u16(&mesh::quad_indices());
+    gl::unbind_index_buffer();
+
+    let vertex_arrays = VertexArrayFns::load();
+    log!("*** Vertex array objects supported: {}", vertex_arrays.is_some());
+    let queries = QueryFns::load();
+    log!("*** Occlusion queries supported: {}", queries.is_some());
+
+    let chunk_box = gl::generate_buffers(1)[0];
+    gl::bind_array_buffer(chunk_box);
+    gl::array_buffer_data_coords(&mesh::chunk_box());
+    let chunk_box_vertex_array = vertex_arrays.as_ref().map(|fns| {
+      let vao = VertexArrayObject::new(fns);
+      vao.bind();
+      gl::vertex_attrib_pointer_u8(position, 3, Coords::size_bytes() as i32, 0);
+      gl::enable_vertex_attrib_array(position);
+      gl::bind_index_buffer(quad_indices);
+      vao.unbind();
+      vao
+    });
+    gl::unbind_array_buffer();
+
     let program = Program {
       id: id,
       vertex_shader: vertex_shader,
       fragment_shader: fragment_shader,
       mvp_matrix: mvp_matrix,
+      chunk_origin: chunk_origin,
       position: position,
       texture_unit: texture_unit,
       texture_coord: texture_coord,
+      quad_indices: quad_indices,
+      vertex_arrays: vertex_arrays,
+      pool: RefCell::new(VertexPool::new()),
+      bound_buffer: Cell::new(0),
+      chunk_box: chunk_box,
+      chunk_box_vertex_array: chunk_box_vertex_array,
+      queries: queries,
+      free_queries: RefCell::new(Vec::new()),
+      frame: Cell::new(0),
     };
     Ok(program)
   }
 
   /// Uploads given vertices into GPU, returns handles to OpenGL buffers.
   pub fn upload_vertices(&self, vertices: &Vertices) -> Buffers {
-    let buffers = gl::generate_buffers(2);
-    if let [vbo, ibo] = &buffers[..] {
-      gl::bind_array_buffer(vbo);
-      gl::array_buffer_data_coords(vertices.coords());
-
-      gl::bind_index_buffer(ibo);
-      gl::index_buffer_data_u16(vertices.indices());
-
-      let position_coords = vertices.position_coord_array();
-      let texture_coords = vertices.texture_coord_array();
-      let buffers = Buffers {
-        vertex_buffer: vbo,
-        position_coord_components: position_coords.components as i32,
-        position_coord_stride: position_coords.stride as i32,
-        position_coord_offset: 0,
-        texture_coord_components: texture_coords.components as i32,
-        texture_coord_stride: texture_coords.stride as i32,
-        texture_coord_offset: Coords::texture_offset(),
-        index_buffer: ibo,
-        index_count: vertices.index_count() as i32,
-      };
-
-      gl::vertex_attrib_pointer_f32(self.position, buffers.position_coord_components,
-        buffers.position_coord_stride, buffers.position_coord_offset);
-      gl::enable_vertex_attrib_array(self.position);
-
-      gl::vertex_attrib_pointer_u16(self.texture_coord, buffers.texture_coord_components,
-        buffers.texture_coord_stride, buffers.texture_coord_offset);
-      gl::enable_vertex_attrib_array(self.texture_coord);
+    self.upload_laid_out(vertices, FaceLayout::tight(&vertices.face_quads()))
+  }
 
-      gl::unbind_array_buffer();
-      gl::unbind_index_buffer();
+  /// Replaces a chunk's mesh by a remesh of it.  If the remesh is at the same level of detail and
+  /// fits the room of the old buffers, its quads are reordered to match the old mesh's and only
+  /// those that changed are written over them.  Otherwise the old buffers are released and the
+  /// remesh is uploaded anew with room to grow.  Returns the buffers and the mesh as uploaded.
+  pub fn update_vertices(&self, buffers: Option<Buffers>, old: Option<&Vertices>,
+    vertices: Vertices) -> (Buffers, Vertices) {
+
+    let patchable = match (buffers.as_ref(), old) {
+      (Some(bs), Some(old)) =>
+        old.lod() == vertices.lod() && bs.layout.fits(&vertices.face_quads()),
+      _ => false,
+    };
+    if !patchable {
+      if let Some(bs) = buffers {
+        self.release(bs);
+      }
+      let layout = FaceLayout::roomy(&vertices.face_quads());
+      return (self.upload_laid_out(&vertices, layout), vertices);
+    }
 
-      // Debug:
-      log!("*** Triangle count: {}, vertex count: {}, bytes: {}",
-        vertices.coord_count() / 2, vertices.coord_count(),
-        vertices.coord_count() * Coords::size_bytes() as usize);
-      buffers
-    } else {
-      panic!("gl::generate_buffers(2) should return 2 buffers");
+    let mut buffers = buffers.unwrap();
+    let (vertices, changed) = vertices.arrange_like(old.unwrap());
+    {
+      let pool = self.pool.borrow();
+      for &(i, first, quads) in changed.iter() {
+        let first = buffers.layout.start(i) + first;
+        let coords = buffers.layout.coords(&vertices, first, quads);
+        pool.write(&buffers.range, 4 * first, &coords);
+      }
     }
+    gl::unbind_array_buffer();
+    self.bound_buffer.set(0);
+    buffers.face_quads = vertices.face_quads();
+    (buffers, vertices)
   }
 
-  pub fn bind_buffers(&self, buffers: &Buffers) {
-    gl::bind_array_buffer(buffers.vertex_buffer);
-    gl::vertex_attrib_pointer_f32(self.position, buffers.position_coord_components,
+  fn upload_laid_out(&self, vertices: &Vertices, layout: FaceLayout) -> Buffers {
+    let vertex_array = self.vertex_arrays.as_ref().map(|fns| VertexArrayObject::new(fns));
+    if let Some(ref vao) = vertex_array {
+      vao.bind();
+    }
+    let coords = layout.coords(vertices, 0, layout.quads());
+    let range = self.pool.borrow_mut().upload(&coords);
+    // GLES2 has no base vertex for glDrawElements, the shared indices start at the range instead.
+    let offset = range.start * Coords::size_bytes();
+
+    let position_coords = vertices.position_coord_array();
+    let texture_coords = vertices.texture_coord_array();
+    let buffers = Buffers {
+      origin: vertices.origin(),
+      range: range,
+      position_coord_components: position_coords.components as i32,
+      position_coord_stride: position_coords.stride as i32,
+      position_coord_offset: offset,
+      texture_coord_components: texture_coords.components as i32,
+      texture_coord_stride: texture_coords.stride as i32,
+      texture_coord_offset: offset + Coords::texture_offset(),
+      extent: vertices.extent() as f32,
+      face_quads: vertices.face_quads(),
+      layout: layout,
+      vertex_array: vertex_array,
+      query: Cell::new(None),
+      queried_frame: Cell::new(0),
+      hidden: Cell::new(false),
+    };
+
+    gl::vertex_attrib_pointer_u8(self.position, buffers.position_coord_components,
       buffers.position_coord_stride, buffers.position_coord_offset);
     gl::enable_vertex_attrib_array(self.position);
 
-    gl::bind_index_buffer(buffers.index_buffer);
-    gl::vertex_attrib_pointer_u16(self.texture_coord, buffers.texture_coord_components,
+    gl::vertex_attrib_pointer_u8(self.texture_coord, buffers.texture_coord_components,
       buffers.texture_coord_stride, buffers.texture_coord_offset);
     gl::enable_vertex_attrib_array(self.texture_coord);
+
+    if let Some(ref vao) = buffers.vertex_array {
+      gl::bind_index_buffer(self.quad_indices);
+      vao.unbind();
+    }
+    gl::unbind_array_buffer();
+    self.bound_buffer.set(0);
+
+    // Debug:
+    log!("*** Triangle count: {}, vertex count: {}, bytes: {}",
+      vertices.coord_count() / 2, vertices.coord_count(),
+      vertices.coord_count() * Coords::size_bytes() as usize);
+    buffers
+  }
+
+  /// Frees a chunk's vertices and occlusion query for reuse.
+  pub fn release(&self, buffers: Buffers) {
+    if let Some(query) = buffers.query.get() {
+      self.free_queries.borrow_mut().push(query);
+    }
+    self.pool.borrow_mut().release(buffers.range);
+  }
+
+  /// Binds a chunk's buffers for drawing.  Binding another chunk's buffers right after is fine,
+  /// `unbind_buffers` only needs to be called after the last one.
+  pub fn bind_buffers(&self, buffers: &Buffers) {
+    gl::uniform_vec3_f32(self.chunk_origin, &buffers.origin);
+    if let Some(ref vao) = buffers.vertex_array {
+      vao.bind();
+      return;
+    }
+
+    if self.bound_buffer.get() != buffers.range.buffer {
+      // Nothing bound yet, or the chunk box with only positions enabled.
+      if self.bound_buffer.get() == 0 || self.bound_buffer.get() == self.chunk_box {
+        gl::bind_index_buffer(self.quad_indices);
+        gl::enable_vertex_attrib_array(self.position);
+        gl::enable_vertex_attrib_array(self.texture_coord);
+      }
+      gl::bind_array_buffer(buffers.range.buffer);
+      self.bound_buffer.set(buffers.range.buffer);
+    }
+    gl::vertex_attrib_pointer_u8(self.position, buffers.position_coord_components,
+      buffers.position_coord_stride, buffers.position_coord_offset);
+    gl::vertex_attrib_pointer_u8(self.texture_coord, buffers.texture_coord_components,
+      buffers.texture_coord_stride, buffers.texture_coord_offset);
+  }
+
+  /// Binds a chunk's buffers and draws the face directions which may face the eye, in as few
+  /// draw calls as there are runs of them.  Back faces of the rest would be culled anyway, but
+  /// only after their vertices got shaded.  Draws nothing for chunks occlusion queries found
+  /// hidden.
+  pub fn draw(&self, buffers: &Buffers, eye: &Point3<f32>) {
+    if self.is_hidden(buffers, eye) {
+      return;
+    }
+    self.bind_buffers(buffers);
+    let facing = mesh::facing_faces(&buffers.origin, buffers.extent, eye);
+    // Runs of facing directions as their first direction and the direction after the last.
+    let mut run = None;
+    for i in 0..7 {
+      match (run, i < 6 && facing[i]) {
+        (None, true) => run = Some(i),
+        (Some(begin), false) => {
+          self.draw_faces(buffers, begin, i);
+          run = None;
+        },
+        _ => {},
+      }
+    }
+  }
+
+  /// Draws face directions [begin, end), from the first quad of begin to the last quad of end - 1
+  /// along with the room between them, which holds degenerate quads.
+  fn draw_faces(&self, buffers: &Buffers, begin: usize, end: usize) {
+    if buffers.face_quads[begin..end].iter().all(|&q| q == 0) {
+      return;
+    }
+    let first = buffers.layout.start(begin);
+    let quads = buffers.layout.start(end - 1) + buffers.face_quads[end - 1] - first;
+    gl::draw_elements_triangles_u16(6 * first, 6 * quads as i32);
+  }
+
+  /// Whether occlusion queries found a chunk hidden.
+  pub fn is_hidden(&self, buffers: &Buffers, eye: &Point3<f32>) -> bool {
+    trusts_hidden(buffers.hidden.get(), buffers.queried_frame.get(), self.frame.get()) &&
+      !near_box(&buffers.origin, eye)
+  }
+
+  /// Draws the boxes of chunks in depth only occlusion queries, to be called after drawing the
+  /// chunks.  First reads back results of earlier frames' queries without waiting for any, hiding
+  /// chunks whose box had no visible samples.  Chunks without a recent result stay visible, as do
+  /// chunks whose box the eye is in or next to, where the near plane may clip the box.
+  pub fn query_occlusion<'a, I: Iterator<Item = &'a Buffers>>(&self, chunks: I,
+    eye: &Point3<f32>) {
+
+    let queries = match self.queries {
+      Some(ref queries) => queries,
+      None => return,
+    };
+    let frame = self.frame.get().wrapping_add(1);
+    self.frame.set(frame);
+
+    self.bind_chunk_box();
+    gl::color_mask(false);
+    gl::depth_mask(false);
+    for bs in chunks {
+      if near_box(&bs.origin, eye) {
+        bs.hidden.set(false);
+        continue;
+      }
+      if let Some(query) = bs.query.get() {
+        if !queries.result_available(query) {
+          continue;
+        }
+        let recent = frame.wrapping_sub(bs.queried_frame.get()) <= STALE_QUERY_FRAMES;
+        bs.hidden.set(recent && !queries.any_samples_passed(query));
+      }
+      let query = match bs.query.get() {
+        Some(query) => query,
+        None => self.free_queries.borrow_mut().pop().unwrap_or_else(|| queries.generate()),
+      };
+      bs.query.set(Some(query));
+      bs.queried_frame.set(frame);
+      gl::uniform_vec3_f32(self.chunk_origin, &bs.origin);
+      queries.begin(query);
+      gl::draw_elements_triangles_u16(0, 6 * 6);
+      queries.end();
+    }
+    gl::color_mask(true);
+    gl::depth_mask(true);
+    self.unbind_buffers();
+  }
+
+  fn bind_chunk_box(&self) {
+    if let Some(ref vao) = self.chunk_box_vertex_array {
+      vao.bind();
+      return;
+    }
+    gl::bind_array_buffer(self.chunk_box);
+    self.bound_buffer.set(self.chunk_box);
+    gl::vertex_attrib_pointer_u8(self.position, 3, Coords::size_bytes() as i32, 0);
+    gl::enable_vertex_attrib_array(self.position);
+    // Texture coordinates would still point into the last chunk's range, past the box's vertices.
+    gl::disable_vertex_attrib_array(self.texture_coord);
+    gl::bind_index_buffer(self.quad_indices);
   }
 
   pub fn unbind_buffers(&self) {
+    if let Some(ref fns) = self.vertex_arrays {
+      fns.unbind();
+      return;
+    }
+    self.bound_buffer.set(0);
+
     gl::disable_vertex_attrib_array(self.position);
     gl::unbind_array_buffer();
 
@@ -188,6 +433,19 @@ impl Program {
   }
 }
 
+/// Whether a chunk found hidden is still taken to be hidden in frame.  Chunks not queried for more
+/// than `STALE_QUERY_FRAMES` frames, like ones coming back into view, are drawn until a fresh
+/// result hides them again.
+fn trusts_hidden(hidden: bool, queried_frame: u32, frame: u32) -> bool {
+  hidden && frame.wrapping_sub(queried_frame) <= STALE_QUERY_FRAMES
+}
+
+/// Whether the eye is in or within a block of a chunk's box.
+fn near_box(origin: &[f32; 3], eye: &Point3<f32>) -> bool {
+  let eye = [eye.x, eye.y, eye.z];
+  (0..3).all(|i| eye[i] > origin[i] - 1.0 && eye[i] < origin[i] + CHUNK_SIZE as f32 + 1.0)
+}
+
 pub struct Shader {
   id: gl::Shader,
 }
@@ -259,3 +517,20 @@ static FRAGMENT_SHADER: &'static str = include_str!("fragment_shader.gles.glsl")
 static VERTEX_SHADER: &'static str = include_str!("vertex_shader.mesa.glsl");
 #[cfg(target_os = "linux")]
 static FRAGMENT_SHADER: &'static str = include_str!("fragment_shader.mesa.glsl");
+
+#[cfg(test)]
+mod tests {
+  use std::u32;
+  use super::{STALE_QUERY_FRAMES, trusts_hidden};
+
+  /// A chunk hidden by its last query is drawn again once that query is stale, as after it left
+  /// the view and came back.
+  #[test]
+  fn stale_hidden_results_are_not_trusted() {
+    assert!(trusts_hidden(true, 10, 10));
+    assert!(trusts_hidden(true, 10, 10 + STALE_QUERY_FRAMES));
+    assert!(!trusts_hidden(true, 10, 11 + STALE_QUERY_FRAMES));
+    assert!(!trusts_hidden(false, 10, 10));
+    assert!(trusts_hidden(true, u32::MAX, 1));
+  }
+}
@@ -0,0 +1,141 @@
+use std::collections::{HashMap, HashSet};
+
+use cgmath::Point3;
+use mesh::Vertices;
+use program::{Buffers, Program};
+use world::{CHUNK_SIZE, Block, Chunk};
+
+/// Chunks along each axis of a region.
+pub const REGION_CHUNKS: i32 = 4;
+
+/// Frames a region's chunks must go unchanged before it is merged, so regions are not rebuilt
+/// over and over while chunks around them load or cross level of detail bands.
+const SETTLE_FRAMES: u32 = 30;
+
+/// A cube of `REGION_CHUNKS`^3 chunks, in regions from the region at the origin.
+#[derive(Clone, Debug, Eq, Hash, PartialEq)]
+pub struct Region(Point3<i32>);
+
+impl Region {
+  pub fn of_chunk(chunk: &Chunk) -> Region {
+    let c = chunk.position();
+    let div = |a: i32| if a >= 0 { a / REGION_CHUNKS } else { (a + 1) / REGION_CHUNKS - 1 };
+    Region(Point3::new(div(c.x), div(c.y), div(c.z)))
+  }
+
+  /// The lowest block of the region's lowest chunk.
+  pub fn origin(&self) -> Block {
+    let n = REGION_CHUNKS;
+    Chunk::new(self.0.x * n, self.0.y * n, self.0.z * n).block_bounds().min
+  }
+}
+
+struct Members {
+  chunks: HashSet<Chunk>,
+  /// Frame a mesh was last added or removed.
+  changed_frame: u32,
+  /// Merged mesh, `None` while changed since it was merged or if there is nothing to merge.
+  buffers: Option<Buffers>,
+}
+
+/// Merges meshes of neighboring chunks into one mesh per region, so distant terrain takes a
+/// draw call per region instead of one per chunk.  Chunk meshes keep their own buffers and are
+/// drawn on their own while their region is not merged.  Merging reads the chunk meshes kept on
+/// the CPU side.
+pub struct Regions {
+  regions: HashMap<Region, Members>,
+  frame: u32,
+}
+
+impl Regions {
+  pub fn new() -> Regions {
+    Regions {
+      regions: HashMap::new(),
+      frame: 0,
+    }
+  }
+
+  /// Adds a chunk or marks its mesh replaced, unmerging its region until it settles again.
+  pub fn insert(&mut self, program: &Program, chunk: Chunk) {
+    let frame = self.frame;
+    let members = self.regions.entry(Region::of_chunk(&chunk)).or_insert_with(|| Members {
+      chunks: HashSet::new(),
+      changed_frame: frame,
+      buffers: None,
+    });
+    members.chunks.insert(chunk);
+    members.changed(program, frame);
+  }
+
+  /// Drops a chunk's mesh, unmerging its region until it settles again.
+  pub fn remove(&mut self, program: &Program, chunk: &Chunk) {
+    let region = Region::of_chunk(chunk);
+    let empty = match self.regions.get_mut(&region) {
+      Some(members) => {
+        if !members.chunks.remove(chunk) {
+          return;
+        }
+        members.changed(program, self.frame);
+        members.chunks.is_empty()
+      },
+      None => return,
+    };
+    if empty {
+      self.regions.remove(&region);
+    }
+  }
+
+  /// Merges at most one region whose chunks settled, once per frame.  Meshes holds every member's
+  /// latest mesh.
+  pub fn update(&mut self, program: &Program, meshes: &HashMap<Chunk, Vertices>) {
+    self.frame += 1;
+    let frame = self.frame;
+    let settled = self.regions.iter_mut()
+      .filter(|&(_, ref m)| m.buffers.is_none() && m.chunks.len() > 1 &&
+        frame - m.changed_frame >= SETTLE_FRAMES)
+      .next();
+    if let Some((region, members)) = settled {
+      let origin = region.origin();
+      let parts: Vec<(&Vertices, [u8; 3])> = members.chunks.iter().map(|c| {
+        let o = c.block_bounds().min;
+        (&meshes[c], [(o.x - origin.x) as u8, (o.y - origin.y) as u8, (o.z - origin.z) as u8])
+      }).collect();
+      match Vertices::merge(&origin, REGION_CHUNKS * CHUNK_SIZE, &parts) {
+        Some(merged) => members.buffers = Some(program.upload_vertices(&merged)),
+        // Too many quads for the shared indices, retried once it settles again.
+        None => members.changed_frame = frame,
+      }
+    }
+  }
+
+  /// Merged mesh of a chunk's region, `None` if the chunk is drawn on its own.
+  pub fn get(&self, chunk: &Chunk) -> Option<&Buffers> {
+    match self.regions.get(&Region::of_chunk(chunk)) {
+      Some(m) if m.chunks.contains(chunk) => m.buffers.as_ref(),
+      _ => None,
+    }
+  }
+}
+
+impl Members {
+  fn changed(&mut self, program: &Program, frame: u32) {
+    self.changed_frame = frame;
+    if let Some(bs) = self.buffers.take() {
+      program.release(bs);
+    }
+  }
+}
+
+#[cfg(test)]
+mod tests {
+  use world::{Block, Chunk};
+  use super::Region;
+
+  #[test]
+  fn region_of_chunk_rounds_down() {
+    assert_eq!(Region::of_chunk(&Chunk::new(0, 0, 3)), Region::of_chunk(&Chunk::new(3, 0, 0)));
+    assert!(Region::of_chunk(&Chunk::new(-1, 0, 0)) != Region::of_chunk(&Chunk::new(0, 0, 0)));
+    assert_eq!(Block::new(-76, -8, 60), Region::of_chunk(&Chunk::new(-4, 0, 7)).origin());
+    assert_eq!(Block::new(-144, -8, -8), Region::of_chunk(&Chunk::new(-5, 0, 0)).origin());
+  }
+}
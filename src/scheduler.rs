@@ -0,0 +1,149 @@
+use std::cmp::Ordering;
+use std::f32::consts::PI;
+
+use fov::Fov;
+use world::Chunk;
+
+/// How far the view may turn before pending chunks get re-sorted, in radians.
+const RESORT_ANGLE: f32 = 5.0 * PI / 180.0;
+
+/// Orders pending chunk generation by what the camera sees: chunks in the field of view first,
+/// then by distance from the FOV vertex.
+///
+/// Priorities are only recomputed lazily, once the view has turned by more than `RESORT_ANGLE`,
+/// the vertex has moved or new chunks were added.  Otherwise picking the next chunk is a pop.
+pub struct Scheduler {
+  /// Pending chunks, from the lowest to the highest priority if `sorted`.
+  pending: Vec<Chunk>,
+  sorted: bool,
+  /// Current view.
+  view: Fov,
+  /// View the pending chunks were last sorted for.
+  sorted_for: Fov,
+}
+
+impl Scheduler {
+  pub fn new(view: &Fov) -> Scheduler {
+    Scheduler {
+      pending: Vec::new(),
+      sorted: true,
+      view: view.clone(),
+      sorted_for: view.clone(),
+    }
+  }
+
+  pub fn push(&mut self, chunk: Chunk) {
+    self.pending.push(chunk);
+    self.sorted = false;
+  }
+
+  /// Drops a chunk which is no longer needed.
+  pub fn cancel(&mut self, chunk: &Chunk) {
+    self.pending.retain(|c| c != chunk);
+  }
+
+  /// Updates the view, cheap enough to call every frame.
+  pub fn set_view(&mut self, view: &Fov) {
+    let moved = view.vertex.x != self.sorted_for.vertex.x ||
+      view.vertex.z != self.sorted_for.vertex.z ||
+      view.view_angle != self.sorted_for.view_angle;
+    if moved || angle_between(view.center_angle, self.sorted_for.center_angle) > RESORT_ANGLE {
+      self.sorted = false;
+    }
+    self.view = view.clone();
+  }
+
+  /// Takes the highest priority chunk.
+  pub fn pop(&mut self) -> Option<Chunk> {
+    if !self.sorted {
+      self.sort();
+    }
+    self.pending.pop()
+  }
+
+  fn sort(&mut self) {
+    let view = &self.view;
+    let mut keyed: Vec<(bool, f32, Chunk)> = self.pending.drain(..).map(|c| {
+      let center = c.xz_center();
+      let (dx, dz) = (center.x - view.vertex.x, center.z - view.vertex.z);
+      (view.chunk_visible(&c), dx * dx + dz * dz, c)
+    }).collect();
+    // Lowest priority first: invisible before visible, then far before near.
+    keyed.sort_by(|a, b| {
+      match a.0.cmp(&b.0) {
+        Ordering::Equal => b.1.partial_cmp(&a.1).unwrap_or(Ordering::Equal),
+        o => o,
+      }
+    });
+    self.pending.extend(keyed.into_iter().map(|(_, _, c)| c));
+    self.sorted = true;
+    self.sorted_for = self.view.clone();
+  }
+}
+
+/// Absolute difference between two angles in radians, in range [0; π].
+fn angle_between(a: f32, b: f32) -> f32 {
+  let diff = (a - b).abs() % (2.0 * PI);
+  if diff > PI {
+    2.0 * PI - diff
+  } else {
+    diff
+  }
+}
+
+#[cfg(test)]
+mod tests {
+  use std::f32::consts::PI;
+  use fov::Fov;
+  use world::{Chunk, Point2};
+  use super::{Scheduler, angle_between};
+
+  fn fov(center_angle: f32) -> Fov {
+    Fov {
+      vertex: Point2::new(0.0, 0.0),
+      center_angle: center_angle,
+      view_angle: 70f32.to_radians(),
+    }
+  }
+
+  #[test]
+  fn pops_visible_chunks_first_then_by_distance() {
+    let mut s = Scheduler::new(&fov(0.0));
+    s.push(Chunk::new(0, 0, -3));
+    s.push(Chunk::new(0, 0, 1));
+    s.push(Chunk::new(0, 0, -1));
+    assert_eq!(s.pop(), Some(Chunk::new(0, 0, -1)));
+    assert_eq!(s.pop(), Some(Chunk::new(0, 0, -3)));
+    assert_eq!(s.pop(), Some(Chunk::new(0, 0, 1)));
+    assert_eq!(s.pop(), None);
+  }
+
+  #[test]
+  fn turning_around_reprioritizes() {
+    let mut s = Scheduler::new(&fov(0.0));
+    s.push(Chunk::new(0, 0, -2));
+    s.push(Chunk::new(0, 0, 3));
+    s.push(Chunk::new(0, 0, -1));
+    assert_eq!(s.pop(), Some(Chunk::new(0, 0, -1)));
+    // Sorted for looking along -z now, only the turn reorders the rest.
+    s.set_view(&fov(PI));
+    assert_eq!(s.pop(), Some(Chunk::new(0, 0, 3)));
+    assert_eq!(s.pop(), Some(Chunk::new(0, 0, -2)));
+  }
+
+  #[test]
+  fn small_turns_keep_order() {
+    let mut s = Scheduler::new(&fov(0.0));
+    s.push(Chunk::new(0, 0, -2));
+    s.push(Chunk::new(0, 0, 3));
+    assert_eq!(s.pop(), Some(Chunk::new(0, 0, -2)));
+    s.set_view(&fov(1f32.to_radians()));
+    assert!(s.sorted);
+  }
+
+  #[test]
+  fn angle_between_wraps() {
+    assert!((angle_between(0.1, 2.0 * PI - 0.1) - 0.2).abs() < 1e-5);
+    assert!((angle_between(PI, 0.0) - PI).abs() < 1e-5);
+  }
+}
@@ -0,0 +1,242 @@
+use std::collections::HashMap;
+
+use world::Chunk;
+
+/// Meshing work to queue for a chunk.
+#[derive(Clone, Copy, Debug, PartialEq)]
+pub enum Work {
+  /// Mesh the whole chunk at a level of detail.
+  Mesh(u32),
+  /// Remesh the sides of a full detail mesh, a bit per face direction.
+  Sides(u32),
+}
+
+struct Meshing {
+  /// Level of detail of the latest full mesh asked for.
+  lod: u32,
+  /// Whether a job is out for the chunk.
+  running: bool,
+  /// Number of the job out for the chunk once it was handed to the loader.
+  job: Option<u32>,
+  /// Whether a full mesh is wanted once the running job is back.
+  remesh: bool,
+  /// Sides wanted remeshed once the running job is back.
+  sides: u32,
+  /// Whether the running job was superseded by meshing on the render thread, its result is to be
+  /// dropped.
+  superseded: bool,
+}
+
+impl Meshing {
+  fn new(lod: u32) -> Meshing {
+    Meshing {
+      lod: lod,
+      running: false,
+      job: None,
+      remesh: false,
+      sides: 0,
+      superseded: false,
+    }
+  }
+}
+
+/// Keeps chunk meshes in step with the neighbors they were meshed next to.  At most one job per
+/// chunk is out at a time and work asked for meanwhile waits for it, so results arrive in the
+/// order they were asked for and side remeshes always patch the mesh they were made for.  Jobs
+/// are told apart by their number, results of jobs the tracker forgot about are stale.
+pub struct MeshTracker {
+  chunks: HashMap<Chunk, Meshing>,
+}
+
+impl MeshTracker {
+  pub fn new() -> MeshTracker {
+    MeshTracker {
+      chunks: HashMap::new(),
+    }
+  }
+
+  /// Asks for a full mesh at a level of detail, true if it should be queued now.
+  pub fn request_mesh(&mut self, chunk: &Chunk, lod: u32) -> bool {
+    let meshing = self.chunks.entry(chunk.clone()).or_insert(Meshing::new(lod));
+    meshing.lod = lod;
+    if meshing.running {
+      meshing.remesh = true;
+      return false;
+    }
+    meshing.running = true;
+    meshing.sides = 0;
+    true
+  }
+
+  /// Asks to remesh the side of a chunk whose neighbor arrived or left, true if it should be
+  /// queued now.  Only full detail meshes depend on their neighbors, coarser ones always show
+  /// their sides.  Chunks never asked to be meshed are ignored, their first mesh sees the
+  /// neighbor.
+  pub fn request_side(&mut self, chunk: &Chunk, side: usize) -> bool {
+    match self.chunks.get_mut(chunk) {
+      Some(ref mut meshing) if meshing.lod == 0 => {
+        if meshing.running {
+          meshing.sides |= 1 << side;
+          return false;
+        }
+        meshing.running = true;
+        true
+      },
+      _ => false,
+    }
+  }
+
+  /// Records that the chunk was just meshed in full on the render thread, superseding any work
+  /// asked for before.  Dropped is whether the loader still held the job out for it, otherwise
+  /// that job is running and its result will be stale.
+  pub fn meshed_now(&mut self, chunk: &Chunk, lod: u32, dropped: bool) {
+    let meshing = self.chunks.entry(chunk.clone()).or_insert(Meshing::new(lod));
+    meshing.lod = lod;
+    meshing.remesh = false;
+    meshing.sides = 0;
+    if meshing.running {
+      meshing.running = !dropped;
+      meshing.superseded = !dropped;
+      if dropped {
+        meshing.job = None;
+      }
+    }
+  }
+
+  /// Records that the job out for a chunk is back, returns the work to queue next.  A full
+  /// remesh covers the sides too.
+  pub fn finished(&mut self, chunk: &Chunk) -> Option<Work> {
+    let meshing = match self.chunks.get_mut(chunk) {
+      Some(meshing) => meshing,
+      None => return None,
+    };
+    meshing.running = false;
+    meshing.job = None;
+    meshing.superseded = false;
+    let work = if meshing.remesh {
+      Some(Work::Mesh(meshing.lod))
+    } else if meshing.sides != 0 && meshing.lod == 0 {
+      Some(Work::Sides(meshing.sides))
+    } else {
+      None
+    };
+    meshing.remesh = false;
+    meshing.sides = 0;
+    meshing.running = work.is_some();
+    work
+  }
+
+  /// Records the number of the job just queued for the work asked for.
+  pub fn started(&mut self, chunk: &Chunk, job: u32) {
+    if let Some(meshing) = self.chunks.get_mut(chunk) {
+      meshing.job = Some(job);
+    }
+  }
+
+  /// Whether a job is out for the chunk.
+  pub fn is_running(&self, chunk: &Chunk) -> bool {
+    self.chunks.get(chunk).map_or(false, |m| m.running)
+  }
+
+  /// Whether the job is the one out for the chunk, results of any other job are stale.
+  pub fn is_awaited(&self, chunk: &Chunk, job: u32) -> bool {
+    self.chunks.get(chunk).map_or(false, |m| m.running && m.job == Some(job))
+  }
+
+  /// Whether the result of the job out for the chunk is still wanted.
+  pub fn is_current(&self, chunk: &Chunk) -> bool {
+    self.chunks.get(chunk).map_or(false, |m| m.running && !m.superseded)
+  }
+
+  /// Chunks whose wanted level of detail, given the latest asked for, differs from it, with the
+  /// wanted one.
+  pub fn changed_lods<F: Fn(&Chunk, u32) -> u32>(&self, wanted: F) -> Vec<(Chunk, u32)> {
+    self.chunks.iter().filter_map(|(c, m)| {
+      let lod = wanted(c, m.lod);
+      if lod != m.lod { Some((c.clone(), lod)) } else { None }
+    }).collect()
+  }
+
+  /// Level of detail of the latest full mesh asked for.
+  pub fn lod(&self, chunk: &Chunk) -> Option<u32> {
+    self.chunks.get(chunk).map(|m| m.lod)
+  }
+
+  pub fn remove(&mut self, chunk: &Chunk) {
+    self.chunks.remove(chunk);
+  }
+}
+
+#[cfg(test)]
+mod tests {
+  use world::Chunk;
+  use super::{MeshTracker, Work};
+
+  /// Work asked for while a job is out waits for it, a full remesh absorbs side remeshes.
+  #[test]
+  fn one_job_per_chunk() {
+    let mut tracker = MeshTracker::new();
+    let c = Chunk::new(0, 0, 0);
+    assert!(!tracker.request_side(&c, 1));
+    assert!(tracker.request_mesh(&c, 0));
+    assert!(!tracker.request_side(&c, 1));
+    assert!(!tracker.request_side(&c, 4));
+    assert!(tracker.is_running(&c));
+    assert_eq!(Some(Work::Sides(1 << 1 | 1 << 4)), tracker.finished(&c));
+    assert!(!tracker.request_side(&c, 0));
+    assert!(!tracker.request_mesh(&c, 0));
+    assert_eq!(Some(Work::Mesh(0)), tracker.finished(&c));
+    assert_eq!(None, tracker.finished(&c));
+    assert!(!tracker.is_running(&c));
+
+    // Coarse meshes ignore their neighbors.
+    assert!(tracker.request_mesh(&c, 1));
+    assert_eq!(None, tracker.finished(&c));
+    assert!(!tracker.request_side(&c, 2));
+    assert_eq!(vec![(c.clone(), 0)], tracker.changed_lods(|_, _| 0));
+  }
+
+  /// Meshing on the render thread drops waiting work, and the result of a job still running.
+  #[test]
+  fn meshing_now_supersedes_jobs() {
+    let mut tracker = MeshTracker::new();
+    let c = Chunk::new(0, 0, 0);
+    assert!(tracker.request_mesh(&c, 0));
+    assert!(!tracker.request_side(&c, 2));
+    tracker.meshed_now(&c, 0, false);
+    assert!(tracker.is_running(&c) && !tracker.is_current(&c));
+    assert!(!tracker.request_mesh(&c, 1));
+    assert_eq!(Some(Work::Mesh(1)), tracker.finished(&c));
+    assert!(tracker.is_current(&c));
+
+    // A job the loader still held is gone.
+    tracker.meshed_now(&c, 0, true);
+    assert!(!tracker.is_running(&c));
+    assert_eq!(None, tracker.finished(&c));
+    tracker.meshed_now(&Chunk::new(1, 0, 0), 0, false);
+    assert!(!tracker.is_running(&Chunk::new(1, 0, 0)));
+  }
+
+  /// A job still running when its chunk is unloaded is not mistaken for the one out after the
+  /// chunk is loaded again.
+  #[test]
+  fn reloading_ignores_old_jobs() {
+    let mut tracker = MeshTracker::new();
+    let c = Chunk::new(0, 0, 0);
+    assert!(tracker.request_mesh(&c, 0));
+    tracker.started(&c, 1);
+    assert!(tracker.is_awaited(&c, 1));
+    tracker.remove(&c);
+    assert!(!tracker.is_awaited(&c, 1));
+
+    assert!(tracker.request_mesh(&c, 0));
+    tracker.started(&c, 2);
+    assert!(!tracker.is_awaited(&c, 1));
+    assert!(tracker.is_awaited(&c, 2));
+    assert!(!tracker.request_side(&c, 3));
+    assert_eq!(Some(Work::Sides(1 << 3)), tracker.finished(&c));
+    assert!(!tracker.is_awaited(&c, 2));
+    tracker.started(&c, 3);
+    assert!(tracker.is_awaited(&c, 3));
+  }
+}
@@ -1,10 +1,16 @@
 #version 130
 uniform mat4 u_MVPMatrix;
+// World position of the chunk's local corner (0, 0, 0).
+uniform vec3 u_ChunkOrigin;
+// Chunk-local block corner, see mesh::Coords.
 attribute vec4 a_Position;
-attribute vec2 a_TextureCoord;
-varying vec2 v_TextureCoord;
+// Repeat counts in xy, atlas tile in zw.
+attribute vec4 a_TextureCoord;
+varying vec2 v_Tile;
+varying vec2 v_Repeat;
 
 void main() {
-  v_TextureCoord = a_TextureCoord;
-  gl_Position = u_MVPMatrix * a_Position;
+  v_Tile = a_TextureCoord.zw;
+  v_Repeat = a_TextureCoord.xy;
+  gl_Position = u_MVPMatrix * vec4(u_ChunkOrigin + a_Position.xyz, 1.0);
 }
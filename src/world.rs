@@ -1,9 +1,10 @@
 use std::collections::{HashMap, HashSet};
-use std::collections::hash_map;
-use time;
+use std::collections::hash_map::Keys;
+use std::mem;
+use std::sync::Arc;
 
 use cgmath;
-use cgmath::{BaseNum, Point3};
+use cgmath::{BaseNum, Point3, Vector3};
 use collision::{Aabb3, Line2};
 
 use perlin;
@@ -13,6 +14,26 @@ pub type Block = Point3<i32>;
 // Has to be odd since (0, 0, 0) is at the center of a chunk.
 pub const CHUNK_SIZE: i32 = 17;
 
+/// Number of blocks in a chunk.
+pub const CHUNK_VOLUME: usize = (CHUNK_SIZE * CHUNK_SIZE * CHUNK_SIZE) as usize;
+
+/// Block type stored in chunk voxel arrays, 0 is empty space.
+pub type BlockId = u8;
+
+pub const EMPTY: BlockId = 0;
+pub const SOLID: BlockId = 1;
+
+/// Directions to the 6 adjacent chunks, in the order of `mesh::CUBE_FACES`: left, right, down, up,
+/// forward, back.
+const NEIGHBOR_DIRECTIONS: [(i32, i32, i32); 6] = [
+  (-1, 0, 0),
+  (1, 0, 0),
+  (0, -1, 0),
+  (0, 1, 0),
+  (0, 0, -1),
+  (0, 0, 1),
+];
+
 #[derive(Clone, Debug, Eq, Hash, PartialEq)]
 pub struct Chunk(Point3<i32>);
 
@@ -25,6 +46,35 @@ impl Chunk {
     })
   }
 
+  /// Chunk containing the given block.
+  pub fn of_block(block: &Block) -> Chunk {
+    Chunk::new(block_to_chunk(block.x), block_to_chunk(block.y), block_to_chunk(block.z))
+  }
+
+  /// Chunk adjacent to this one in the given direction.
+  pub fn neighbor(&self, direction: &Vector3<i32>) -> Chunk {
+    Chunk::new(self.0.x + direction.x, self.0.y + direction.y, self.0.z + direction.z)
+  }
+
+  /// The 6 adjacent chunks, in the order of `NEIGHBOR_DIRECTIONS`.
+  pub fn neighbors(&self) -> [Chunk; 6] {
+    let n = |i: usize| {
+      let (x, y, z) = NEIGHBOR_DIRECTIONS[i];
+      self.neighbor(&Vector3::new(x, y, z))
+    };
+    [n(0), n(1), n(2), n(3), n(4), n(5)]
+  }
+
+  /// Chunk coordinates, in chunks from the chunk at the origin.
+  pub fn position(&self) -> Point3<i32> {
+    self.0
+  }
+
+  /// Center of the chunk on xz plane.
+  pub fn xz_center(&self) -> Point2<f32> {
+    Point2::new((self.0.x * CHUNK_SIZE) as f32, (self.0.z * CHUNK_SIZE) as f32)
+  }
+
   pub fn block_bounds(&self) -> Aabb3<i32> {
     let center = Point3 {
       x: self.0.x * CHUNK_SIZE,
@@ -47,14 +97,144 @@ impl Chunk {
   }
 }
 
+/// Dense voxel array for one chunk, indexed by coordinates local to the chunk's minimum corner.
+pub struct ChunkBlocks {
+  /// World coordinates of the block at local (0, 0, 0).
+  origin: Block,
+  /// Block ids in y, z, x order, x varies fastest.
+  ids: Box<[BlockId; CHUNK_VOLUME]>,
+  /// Number of non-empty blocks.
+  count: usize,
+}
+
+impl ChunkBlocks {
+  /// Creates an empty chunk covering the given bounds.
+  pub fn new(bounds: &Aabb3<i32>) -> ChunkBlocks {
+    assert!(bounds.max.x - bounds.min.x + 1 == CHUNK_SIZE &&
+      bounds.max.y - bounds.min.y + 1 == CHUNK_SIZE &&
+      bounds.max.z - bounds.min.z + 1 == CHUNK_SIZE, "Not chunk bounds: {:?}", bounds);
+    ChunkBlocks {
+      origin: bounds.min,
+      ids: Box::new([EMPTY; CHUNK_VOLUME]),
+      count: 0,
+    }
+  }
+
+  #[inline]
+  fn index(x: i32, y: i32, z: i32) -> usize {
+    ((y * CHUNK_SIZE + z) * CHUNK_SIZE + x) as usize
+  }
+
+  /// Whether local coordinates are within the chunk.
+  #[inline]
+  pub fn in_chunk(x: i32, y: i32, z: i32) -> bool {
+    x >= 0 && x < CHUNK_SIZE && y >= 0 && y < CHUNK_SIZE && z >= 0 && z < CHUNK_SIZE
+  }
+
+  /// Block id at local coordinates, which must be within the chunk.
+  #[inline]
+  pub fn get_local(&self, x: i32, y: i32, z: i32) -> BlockId {
+    debug_assert!(ChunkBlocks::in_chunk(x, y, z));
+    self.ids[ChunkBlocks::index(x, y, z)]
+  }
+
+  #[inline]
+  pub fn contains_local(&self, x: i32, y: i32, z: i32) -> bool {
+    self.get_local(x, y, z) != EMPTY
+  }
+
+  /// Sets the block id at world coordinates, which must be within the chunk.
+  pub fn set(&mut self, block: &Block, id: BlockId) {
+    let (x, y, z) = (block.x - self.origin.x, block.y - self.origin.y, block.z - self.origin.z);
+    assert!(ChunkBlocks::in_chunk(x, y, z), "Block {:?} outside chunk at {:?}", block, self.origin);
+    let slot = &mut self.ids[ChunkBlocks::index(x, y, z)];
+    match (*slot != EMPTY, id != EMPTY) {
+      (false, true) => self.count += 1,
+      (true, false) => self.count -= 1,
+      _ => (),
+    }
+    *slot = id;
+  }
+
+  pub fn contains(&self, block: &Block) -> bool {
+    let (x, y, z) = (block.x - self.origin.x, block.y - self.origin.y, block.z - self.origin.z);
+    ChunkBlocks::in_chunk(x, y, z) && self.contains_local(x, y, z)
+  }
+
+  #[inline]
+  pub fn origin(&self) -> Block {
+    self.origin
+  }
+
+  #[inline]
+  pub fn len(&self) -> usize {
+    self.count
+  }
+
+  /// World y of the highest non-empty block in the column at world (x, z).
+  fn column_top(&self, x: i32, z: i32) -> Option<i32> {
+    let (x, z) = (x - self.origin.x, z - self.origin.z);
+    if !ChunkBlocks::in_chunk(x, 0, z) {
+      return None;
+    }
+    (0..CHUNK_SIZE).rev().find(|&y| self.contains_local(x, y, z)).map(|y| self.origin.y + y)
+  }
+}
+
+/// Copied when a chunk gets edited while meshing jobs still hold it.
+impl Clone for ChunkBlocks {
+  fn clone(&self) -> ChunkBlocks {
+    let mut ids = Box::new([EMPTY; CHUNK_VOLUME]);
+    ids.copy_from_slice(&self.ids[..]);
+    ChunkBlocks {
+      origin: self.origin,
+      ids: ids,
+      count: self.count,
+    }
+  }
+}
+
+/// A chunk's voxels together with those of its 6 neighbors, as a snapshot that can be meshed on
+/// a background thread.
+pub struct Neighborhood {
+  pub chunk: Chunk,
+  pub blocks: Arc<ChunkBlocks>,
+  /// Adjacent chunks in the order of `mesh::CUBE_FACES`, `None` if not generated.
+  pub neighbors: [Option<Arc<ChunkBlocks>>; 6],
+}
+
 /// World model 𝓦.
+///
+/// Chunks are streamed in: the world only records which chunks it still needs, they get
+/// generated elsewhere (see `loader`) and handed back via `insert`.
 pub struct World {
-  /// All blocks in the world.
-  blocks: HashSet<Block>,
-  /// Blocks divided by chunk they belong to.
-  chunk_blocks: HashMap<Chunk, Vec<Block>>,
+  /// Voxels of all generated chunks.
+  chunks: HashMap<Chunk, Arc<ChunkBlocks>>,
+  /// Total number of blocks in all chunks.
+  block_count: usize,
   /// Eye coordinates.
   eye: Option<Point3<i32>>,
+  /// Chunks needed but not generated yet.
+  pending: HashSet<Chunk>,
+  /// Pending chunks not yet handed out by `take_requests`.
+  requests: Vec<Chunk>,
+  /// Generated chunks whose neighbors are all generated, not yet handed out by `take_ready`.
+  ready: Vec<Chunk>,
+  /// Chunks which have been ready, later changes of their neighbors are border changes.
+  meshable: HashSet<Chunk>,
+  /// Meshable chunks and the side of each whose neighbor arrived or left, not yet handed out by
+  /// `take_border_changes`.
+  border_changes: Vec<(Chunk, usize)>,
+  /// Meshable chunks with edited blocks, not yet handed out by `take_edited`.
+  edited: Vec<Chunk>,
+  /// Meshable chunks and the side of each facing an edited block of their neighbor, not yet
+  /// handed out by `take_edited_sides`.
+  edited_sides: Vec<(Chunk, usize)>,
+  /// Chunk the eye is in, chunks within the window around it are kept loaded.
+  center: Chunk,
+  window: Window,
+  /// Chunks that left the window, not yet handed out by `take_unloaded`.
+  unloaded: Vec<Chunk>,
 }
 
 /// 2 dimensional point on xz plane.
@@ -111,60 +291,285 @@ struct Rect2<T> {
 }
 
 impl World {
-  /// Generates world chunks visible from the start point within the radius.
+  /// Generates the chunk at the start point to place the eye in, requests all other chunks visible
+  /// from there within the radius.
   pub fn new(start: &Point2<f32>, radius: f32) -> World {
-    let start_s = time::precise_time_s();
-    log!("*** Generating world...");
-
-    // TODO: Load the chunk at (0, 0, 0) synchronously, load other chunks within radius in the
-    // background, while prioritizing chunks in the field of view.
-    let mut all_blocks: HashSet<Block> = HashSet::new();
     assert!(radius > 0.0);
     let capacity_estimate = radius as usize * radius as usize;
-    let mut chunk_blocks: HashMap<Chunk, Vec<Block>> = HashMap::with_capacity(capacity_estimate);
-
-    let eye = {
-      let chunk0 = Chunk::new(0, 0, 0);
-      let blocks0 = perlin::generate_blocks(&chunk0.block_bounds());
-      all_blocks.extend(blocks0.clone());
-      chunk_blocks.insert(chunk0, blocks0.clone());
-
-      let start_block = Point2 {
-        x: coord_to_block(start.x),
-        z: coord_to_block(start.z),
-      };
-      place_eye(&blocks0, &start_block)
+
+    let start_block = Point2 {
+      x: coord_to_block(start.x),
+      z: coord_to_block(start.z),
     };
+    let chunk0 = Chunk::of_block(&Block::new(start_block.x, 0, start_block.z));
+    let blocks0 = perlin::generate_blocks(&chunk0.block_bounds());
+    let eye = place_eye(&blocks0, &start_block);
+
+    let window = Window::new(radius);
+    let requests: Vec<Chunk> = window.chunks_around(&chunk0).into_iter()
+      .filter(|c| *c != chunk0)
+      .collect();
+    let mut pending: HashSet<Chunk> = requests.iter().cloned().collect();
+    pending.insert(chunk0.clone());
+    let mut world = World {
+      chunks: HashMap::with_capacity(capacity_estimate),
+      block_count: 0,
+      eye: eye,
+      pending: pending,
+      requests: requests,
+      ready: Vec::new(),
+      meshable: HashSet::new(),
+      border_changes: Vec::new(),
+      edited: Vec::new(),
+      edited_sides: Vec::new(),
+      center: chunk0.clone(),
+      window: window,
+      unloaded: Vec::new(),
+    };
+    world.insert(chunk0, Arc::new(blocks0));
+    world
+  }
 
-    for c in within_radius_iter(start, radius) {
-      let blocks = perlin::generate_blocks(&c.block_bounds());
-      all_blocks.extend(blocks.clone());
-      chunk_blocks.insert(c, blocks);
+  /// Moves the eye to a new point on xz plane, on top of the highest block there if it is loaded
+  /// or the terrain surface height is known.
+  /// Once the eye crosses into another chunk, chunks leaving the window get unloaded and the ones
+  /// entering it get requested.
+  pub fn move_eye(&mut self, xz: &Point2<f32>) {
+    let block = Block::new(coord_to_block(xz.x), 0, coord_to_block(xz.z));
+    let chunk = Chunk::of_block(&block);
+    let top = perlin::surface_height(block.x, block.z).or_else(||
+      self.chunks.get(&chunk).and_then(|bs| bs.column_top(block.x, block.z)));
+    self.eye = match (top, self.eye) {
+      (Some(y), _) => Some(Point3::new(block.x, y, block.z)),
+      (None, Some(e)) => Some(Point3::new(block.x, e.y, block.z)),
+      (None, None) => None,
+    };
+    if chunk != self.center {
+      self.recenter(chunk);
     }
+  }
 
-    let spent_ms = (time::precise_time_s() - start_s) * 1000.0;
-    log!("*** Generated world: {:.3}ms, {} chunks, {} blocks", spent_ms, chunk_blocks.len(), all_blocks.len());
+  /// Slides the window to a new center chunk.  Steps to an adjacent chunk only visit the
+  /// precomputed ring differences, longer jumps compare whole windows.
+  fn recenter(&mut self, center: Chunk) {
+    let (entering, leaving) = {
+      let (dx, dz) = (center.0.x - self.center.0.x, center.0.z - self.center.0.z);
+      match self.window.step(dx, dz) {
+        Some(&(ref entering, ref leaving)) => {
+          (translate(entering, &center), translate(leaving, &self.center))
+        },
+        None => {
+          let old: HashSet<Chunk> = self.window.chunks_around(&self.center).into_iter().collect();
+          let new: HashSet<Chunk> = self.window.chunks_around(&center).into_iter().collect();
+          (new.difference(&old).cloned().collect(), old.difference(&new).cloned().collect())
+        },
+      }
+    };
+    log!("*** Moved to chunk {:?}: {} chunks entering, {} leaving", center, entering.len(),
+      leaving.len());
 
-    World {
-      blocks: all_blocks,
-      chunk_blocks: chunk_blocks,
-      eye: eye,
+    for c in leaving {
+      self.unload(c);
+    }
+    for c in entering {
+      self.pending.insert(c.clone());
+      self.requests.push(c);
+    }
+    self.center = center;
+  }
+
+  fn unload(&mut self, chunk: Chunk) {
+    if self.pending.remove(&chunk) {
+      self.requests.retain(|c| *c != chunk);
+      // Neighbors waiting on it may be ready now.
+      for n in chunk.neighbors().iter() {
+        if self.chunks.contains_key(n) && self.neighbors_generated(n) {
+          self.make_ready(n);
+        }
+      }
+    } else if let Some(blocks) = self.chunks.remove(&chunk) {
+      self.block_count -= blocks.len();
+      self.meshable.remove(&chunk);
+      self.ready.retain(|c| *c != chunk);
+      self.border_changes.retain(|&(ref c, _)| *c != chunk);
+      self.edited.retain(|c| *c != chunk);
+      self.edited_sides.retain(|&(ref c, _)| *c != chunk);
+      self.report_border_changes(&chunk);
     }
+    self.unloaded.push(chunk);
+  }
+
+  /// Hands out chunks that left the window, whether generated or still pending, each only once.
+  pub fn take_unloaded(&mut self) -> Vec<Chunk> {
+    mem::replace(&mut self.unloaded, Vec::new())
   }
 
+  /// Whether the chunk is generated and within the window.
   #[inline]
-  pub fn len(&self) -> usize {
-    self.blocks.len()
+  pub fn contains_chunk(&self, chunk: &Chunk) -> bool {
+    self.chunks.contains_key(chunk)
+  }
+
+  /// Hands out chunks that need to be generated, each only once.
+  pub fn take_requests(&mut self) -> Vec<Chunk> {
+    mem::replace(&mut self.requests, Vec::new())
+  }
+
+  /// Adds a generated chunk, ignored if the chunk has left the window since it was requested.  The
+  /// chunk and its neighbors become ready for meshing once none of their neighbors are pending any
+  /// more, see `take_ready`.
+  pub fn insert(&mut self, chunk: Chunk, blocks: Arc<ChunkBlocks>) {
+    if !self.pending.remove(&chunk) {
+      return;
+    }
+    self.block_count += blocks.len();
+    self.chunks.insert(chunk.clone(), blocks);
+
+    // Each chunk gets reported ready once.  Neighbors which were ready before this chunk entered
+    // the window get a border change instead, so that their meshes drop faces hidden by it.
+    if self.neighbors_generated(&chunk) {
+      self.make_ready(&chunk);
+    }
+    self.report_border_changes(&chunk);
+    for n in chunk.neighbors().iter() {
+      if self.chunks.contains_key(n) && self.neighbors_generated(n) {
+        self.make_ready(n);
+      }
+    }
+  }
+
+  fn neighbors_generated(&self, chunk: &Chunk) -> bool {
+    chunk.neighbors().iter().all(|n| !self.pending.contains(n))
+  }
+
+  fn make_ready(&mut self, chunk: &Chunk) {
+    if self.meshable.insert(chunk.clone()) {
+      self.ready.push(chunk.clone());
+    }
+  }
+
+  /// Records a border change for each meshable neighbor of a chunk which arrived or left.
+  fn report_border_changes(&mut self, chunk: &Chunk) {
+    for (i, n) in chunk.neighbors().iter().enumerate() {
+      if self.meshable.contains(n) {
+        // Sides come in pairs, the chunk is on the opposite side of its neighbor.
+        self.border_changes.push((n.clone(), i ^ 1));
+      }
+    }
   }
 
+  /// Hands out chunks that can be meshed: generated, with all neighbors generated.  Each chunk
+  /// only once while it stays loaded.
+  pub fn take_ready(&mut self) -> Vec<Chunk> {
+    mem::replace(&mut self.ready, Vec::new())
+  }
+
+  /// Reports every meshable chunk ready again, for meshing them anew after their meshes were lost.
+  /// Pending border changes and edits are dropped, the new meshes see them.
+  #[cfg(any(test, target_os = "android"))]
+  pub fn ready_all(&mut self) {
+    self.ready = self.meshable.iter().cloned().collect();
+    self.border_changes.clear();
+    self.edited.clear();
+    self.edited_sides.clear();
+  }
+
+  /// Hands out meshable chunks with the side facing a neighbor which arrived or left since, each
+  /// change only once.
+  pub fn take_border_changes(&mut self) -> Vec<(Chunk, usize)> {
+    mem::replace(&mut self.border_changes, Vec::new())
+  }
+
+  /// Sets the block at world coordinates, `EMPTY` removes it.  Returns false if its chunk is not
+  /// loaded.  The chunk gets reported edited, see `take_edited`, and if the block is on one of the
+  /// chunk's sides, so does the neighbor's side facing it, see `take_edited_sides`.  Snapshots
+  /// handed out for meshing keep the blocks they were taken with.
+  #[allow(dead_code)]
+  pub fn set_block(&mut self, block: &Block, id: BlockId) -> bool {
+    let chunk = Chunk::of_block(block);
+    match self.chunks.get_mut(&chunk) {
+      Some(blocks) => {
+        let blocks = Arc::make_mut(blocks);
+        self.block_count -= blocks.len();
+        blocks.set(block, id);
+        self.block_count += blocks.len();
+      },
+      None => return false,
+    }
+    if self.meshable.contains(&chunk) && !self.edited.contains(&chunk) {
+      self.edited.push(chunk.clone());
+    }
+    let origin = chunk.block_bounds().min;
+    let (x, y, z) = (block.x - origin.x, block.y - origin.y, block.z - origin.z);
+    let last = CHUNK_SIZE - 1;
+    let on_side = [x == 0, x == last, y == 0, y == last, z == 0, z == last];
+    for (i, n) in chunk.neighbors().iter().enumerate() {
+      let facing = (n.clone(), i ^ 1);
+      if on_side[i] && self.meshable.contains(n) && !self.edited_sides.contains(&facing) {
+        self.edited_sides.push(facing);
+      }
+    }
+    true
+  }
+
+  /// Removes the block at world coordinates, see `set_block`.
+  #[allow(dead_code)]
+  pub fn remove_block(&mut self, block: &Block) -> bool {
+    self.set_block(block, EMPTY)
+  }
+
+  /// Hands out meshable chunks whose blocks were edited since, each only once.
+  pub fn take_edited(&mut self) -> Vec<Chunk> {
+    mem::replace(&mut self.edited, Vec::new())
+  }
+
+  /// Hands out meshable chunks with the side facing blocks their neighbor had edited since, each
+  /// only once.
+  pub fn take_edited_sides(&mut self) -> Vec<(Chunk, usize)> {
+    mem::replace(&mut self.edited_sides, Vec::new())
+  }
+
+  /// Whether some requested chunks have not been generated yet.
   #[inline]
-  pub fn chunk_blocks(&self) -> hash_map::Iter<Chunk, Vec<Block>> {
-    self.chunk_blocks.iter()
+  pub fn is_loading(&self) -> bool {
+    !self.pending.is_empty()
+  }
+
+  #[inline]
+  pub fn chunk_count(&self) -> usize {
+    self.chunks.len()
+  }
+
+  /// Loaded chunks, in no particular order.
+  #[allow(dead_code)]
+  pub fn chunks(&self) -> Keys<Chunk, Arc<ChunkBlocks>> {
+    self.chunks.keys()
   }
 
   #[inline]
+  pub fn len(&self) -> usize {
+    self.block_count
+  }
+
+  /// Snapshot of a generated chunk and its neighbors for meshing.
+  pub fn neighborhood(&self, chunk: &Chunk) -> Option<Neighborhood> {
+    self.chunks.get(chunk).map(|blocks| {
+      let ns = chunk.neighbors();
+      let n = |i: usize| self.chunks.get(&ns[i]).cloned();
+      Neighborhood {
+        chunk: chunk.clone(),
+        blocks: blocks.clone(),
+        neighbors: [n(0), n(1), n(2), n(3), n(4), n(5)],
+      }
+    })
+  }
+
+  #[allow(dead_code)]
   pub fn contains(&self, block: &Block) -> bool {
-    self.blocks.contains(block)
+    match self.chunks.get(&Chunk::of_block(block)) {
+      Some(bs) => bs.contains(block),
+      None => false,
+    }
   }
 
   #[inline]
@@ -173,6 +578,56 @@ impl World {
   }
 }
 
+/// Chunk columns within a radius around a center chunk, plus the differences between windows
+/// around adjacent centers.
+struct Window {
+  /// Chunk offsets from the center within the radius, (0, 0) first.
+  offsets: Vec<(i32, i32)>,
+  /// For each center step in `STEPS`: offsets from the new center entering the window and offsets
+  /// from the old center leaving it.
+  steps: Vec<(Vec<(i32, i32)>, Vec<(i32, i32)>)>,
+}
+
+/// Moves of the center to an adjacent chunk column.
+const STEPS: [(i32, i32); 8] = [(-1, -1), (0, -1), (1, -1), (-1, 0), (1, 0), (-1, 1), (0, 1), (1, 1)];
+
+impl Window {
+  fn new(radius: f32) -> Window {
+    let mut offsets = vec![(0, 0)];
+    offsets.extend(within_radius_iter(&Point2::new(0.0, 0.0), radius).map(|c| (c.0.x, c.0.z)));
+
+    let steps = {
+      let contains = |o: &(i32, i32)| offsets.contains(o);
+      STEPS.iter().map(|&(dx, dz)| {
+        // Moving from c0 to c1 = c0 + d: c1 + o enters iff o + d is outside, c0 + o leaves iff
+        // o - d is outside.
+        let entering = offsets.iter().cloned().filter(|&(x, z)| !contains(&(x + dx, z + dz)));
+        let leaving = offsets.iter().cloned().filter(|&(x, z)| !contains(&(x - dx, z - dz)));
+        (entering.collect(), leaving.collect())
+      }).collect()
+    };
+
+    Window {
+      offsets: offsets,
+      steps: steps,
+    }
+  }
+
+  fn chunks_around(&self, center: &Chunk) -> Vec<Chunk> {
+    translate(&self.offsets, center)
+  }
+
+  /// Entering and leaving offsets for a center move, `None` unless it is to an adjacent column.
+  fn step(&self, dx: i32, dz: i32) -> Option<&(Vec<(i32, i32)>, Vec<(i32, i32)>)> {
+    STEPS.iter().position(|&s| s == (dx, dz)).map(|i| &self.steps[i])
+  }
+}
+
+/// Chunks at given xz offsets from the center chunk.
+fn translate(offsets: &[(i32, i32)], center: &Chunk) -> Vec<Chunk> {
+  offsets.iter().map(|&(x, z)| Chunk::new(center.0.x + x, center.0.y, center.0.z + z)).collect()
+}
+
 struct WithinRadiusIterator {
   center: Point2<f32>,
   radius: f32,
@@ -241,6 +696,18 @@ fn coord_to_chunk(coord: f32) -> i32 {
   (coord / CHUNK_SIZE as f32).round() as i32
 }
 
+/// Chunk coordinate for a block coordinate, chunk 0 spans [-(CHUNK_SIZE - 1) / 2; (CHUNK_SIZE - 1) / 2].
+#[inline]
+fn block_to_chunk(coord: i32) -> i32 {
+  let shifted = coord + (CHUNK_SIZE - 1) / 2;
+  // Integer division rounding towards negative infinity.
+  if shifted >= 0 {
+    shifted / CHUNK_SIZE
+  } else {
+    (shifted + 1) / CHUNK_SIZE - 1
+  }
+}
+
 #[inline]
 fn coord_to_block(coord: f32) -> i32 {
   coord.round() as i32
@@ -289,15 +756,8 @@ fn distance_squared(p1: &Point2<f32>, p2: &Point2<f32>) -> f32 {
 }
 
 /// Place the eye on top of the highest block: max {y: (xz.x, y, xz.z) ∈ 𝓦}
-fn place_eye(blocks: &Vec<Block>, xz: &Point2<i32>) -> Option<Point3<i32>> {
-  let y_of_matching_xz = |b: &Block| -> Option<i32> {
-    if b.x == xz.z && b.z == xz.x {
-      Some(b.y)
-    } else {
-      None
-    }
-  };
-  let max_y = blocks.iter().filter_map(|&b| y_of_matching_xz(&b)).max();
+fn place_eye(blocks: &ChunkBlocks, xz: &Point2<i32>) -> Option<Point3<i32>> {
+  let max_y = perlin::surface_height(xz.x, xz.z).or_else(|| blocks.column_top(xz.x, xz.z));
   max_y.map(|y| {
     log!("*** Placed eye at: ({}, {}, {})", xz.x, y, xz.z);
     Point3::new(xz.x, y, xz.z)
@@ -306,8 +766,12 @@ fn place_eye(blocks: &Vec<Block>, xz: &Point2<i32>) -> Option<Point3<i32>> {
 
 #[cfg(test)]
 mod tests {
+  use std::collections::HashSet;
   use std::ops::Not;
-  use super::{CHUNK_SIZE, Point2, coord_to_chunk, within_radius,  within_radius_iter};
+  use std::sync::Arc;
+  use perlin;
+  use super::{Block, CHUNK_SIZE, Chunk, ChunkBlocks, EMPTY, Point2, SOLID, STEPS, Window, World,
+    block_to_chunk, coord_to_chunk, translate, within_radius,  within_radius_iter};
 
   #[test]
   fn coord_to_chunk_test_center_0() {
@@ -361,4 +825,187 @@ mod tests {
     let it = within_radius_iter(&origin, 0.7072 * CHUNK_SIZE as f32);
     assert_eq!(it.count(), 8);
   }
+
+  #[test]
+  fn block_to_chunk_test_center_0() {
+    assert_eq!(block_to_chunk(0), 0);
+    assert_eq!(block_to_chunk(8), 0);
+    assert_eq!(block_to_chunk(-8), 0);
+  }
+
+  #[test]
+  fn block_to_chunk_test_neighbors() {
+    assert_eq!(block_to_chunk(9), 1);
+    assert_eq!(block_to_chunk(25), 1);
+    assert_eq!(block_to_chunk(26), 2);
+    assert_eq!(block_to_chunk(-9), -1);
+    assert_eq!(block_to_chunk(-25), -1);
+    assert_eq!(block_to_chunk(-26), -2);
+  }
+
+  #[test]
+  fn chunk_blocks_set_and_contains() {
+    let chunk = Chunk::new(-1, 0, 2);
+    let mut blocks = ChunkBlocks::new(&chunk.block_bounds());
+    let b = Block::new(-20, 3, 40);
+    assert!(blocks.contains(&b).not());
+    blocks.set(&b, SOLID);
+    assert!(blocks.contains(&b));
+    assert_eq!(Chunk::of_block(&b), chunk);
+    assert!(blocks.contains(&Block::new(-21, 3, 40)).not());
+    assert!(blocks.contains(&Block::new(0, 0, 0)).not());
+    assert_eq!(blocks.len(), 1);
+    blocks.set(&b, EMPTY);
+    assert_eq!(blocks.len(), 0);
+  }
+
+  /// Each chunk becomes ready for meshing exactly once, after its last pending neighbor arrives.
+  #[test]
+  fn world_insert_reports_ready_chunks_once() {
+    let mut world = World::new(&Point2::new(0.0, 0.0), 0.7072 * CHUNK_SIZE as f32);
+    let requests = world.take_requests();
+    assert_eq!(requests.len(), 8);
+    assert!(world.take_requests().is_empty());
+    assert!(world.take_ready().is_empty());
+
+    let mut ready = Vec::new();
+    for c in requests {
+      let blocks = perlin::generate_blocks(&c.block_bounds());
+      world.insert(c, Arc::new(blocks));
+      ready.extend(world.take_ready());
+    }
+    assert!(world.is_loading().not());
+    assert_eq!(ready.len(), 9);
+    for c in ready.iter() {
+      assert_eq!(ready.iter().filter(|&r| r == c).count(), 1);
+    }
+  }
+
+  /// Chunks which were ready get border changes when a neighbor arrives or leaves, not readied
+  /// again.
+  #[test]
+  fn world_reports_border_changes() {
+    let mut world = World::new(&Point2::new(0.0, 0.0), 0.7072 * CHUNK_SIZE as f32);
+    for c in world.take_requests() {
+      let blocks = perlin::generate_blocks(&c.block_bounds());
+      world.insert(c, Arc::new(blocks));
+    }
+    assert_eq!(world.take_ready().len(), 9);
+    assert!(world.take_border_changes().is_empty());
+
+    // The window moves one chunk along +x.
+    world.move_eye(&Point2::new(CHUNK_SIZE as f32, 0.0));
+    let mut changes = world.take_border_changes();
+    changes.sort_by_key(|&(ref c, i)| (c.0.x, c.0.z, i));
+    // Chunks in column x = -1 left, the ones at x = 0 lost their left neighbors.
+    assert_eq!(vec![(Chunk::new(0, 0, -1), 0), (Chunk::new(0, 0, 0), 0), (Chunk::new(0, 0, 1), 0)],
+      changes);
+    for c in world.take_requests() {
+      let blocks = perlin::generate_blocks(&c.block_bounds());
+      world.insert(c, Arc::new(blocks));
+    }
+    let ready = world.take_ready();
+    assert_eq!(3, ready.len());
+    assert!(ready.iter().all(|c| c.0.x == 2));
+    let changes = world.take_border_changes();
+    assert!(changes.contains(&(Chunk::new(1, 0, 0), 1)));
+    assert!(changes.iter().all(|&(ref c, i)| c.0.x == 1 && i == 1 || c.0.x == 2));
+  }
+
+  /// Edits change the chunk's blocks without touching snapshots, blocks on a side also change the
+  /// neighbor's border.
+  #[test]
+  fn world_set_block_reports_edits() {
+    let mut world = World::new(&Point2::new(0.0, 0.0), 0.7072 * CHUNK_SIZE as f32);
+    for c in world.take_requests() {
+      let blocks = perlin::generate_blocks(&c.block_bounds());
+      world.insert(c, Arc::new(blocks));
+    }
+    world.take_ready();
+    let chunk = Chunk::new(0, 0, 0);
+    let min = chunk.block_bounds().min;
+    let inside = Block::new(min.x + 3, min.y + CHUNK_SIZE - 1, min.z + 5);
+    let snapshot = world.neighborhood(&chunk).unwrap();
+    let len = world.len();
+
+    assert!(world.set_block(&inside, SOLID));
+    assert!(world.contains(&inside));
+    assert!(!snapshot.blocks.contains(&inside));
+    assert_eq!(len + 1, world.len());
+    assert_eq!(vec![chunk.clone()], world.take_edited());
+    // The top side has no meshable neighbor.
+    assert!(world.take_edited_sides().is_empty());
+
+    let side = Block::new(min.x + CHUNK_SIZE - 1, min.y, min.z);
+    world.remove_block(&side);
+    world.set_block(&side, SOLID);
+    assert_eq!(vec![chunk.clone()], world.take_edited());
+    assert_eq!(vec![(Chunk::new(1, 0, 0), 0), (Chunk::new(0, 0, -1), 5)],
+      world.take_edited_sides());
+    assert!(world.take_border_changes().is_empty());
+    assert!(!world.set_block(&Block::new(1000, 0, 0), SOLID));
+  }
+
+  /// Meshable chunks get readied again once their meshes are lost, without their pending
+  /// edits.
+  #[test]
+  fn world_ready_all_remeshes_meshable_chunks() {
+    let mut world = World::new(&Point2::new(0.0, 0.0), 0.7072 * CHUNK_SIZE as f32);
+    for c in world.take_requests() {
+      let blocks = perlin::generate_blocks(&c.block_bounds());
+      world.insert(c, Arc::new(blocks));
+    }
+    let mut ready = world.take_ready();
+    let min = Chunk::new(0, 0, 0).block_bounds().min;
+    world.set_block(&Block::new(min.x, min.y, min.z), SOLID);
+
+    world.ready_all();
+    let mut again = world.take_ready();
+    ready.sort_by_key(|c| (c.0.x, c.0.z));
+    again.sort_by_key(|c| (c.0.x, c.0.z));
+    assert_eq!(ready, again);
+    assert!(world.take_edited().is_empty());
+    assert!(world.take_edited_sides().is_empty());
+  }
+
+  /// Precomputed ring differences match comparing whole windows.
+  #[test]
+  fn window_steps_match_full_difference() {
+    let window = Window::new(3.0 * CHUNK_SIZE as f32);
+    let c0 = Chunk::new(2, 0, -1);
+    let old: HashSet<Chunk> = window.chunks_around(&c0).into_iter().collect();
+    for &(dx, dz) in STEPS.iter() {
+      let c1 = Chunk::new(2 + dx, 0, -1 + dz);
+      let new: HashSet<Chunk> = window.chunks_around(&c1).into_iter().collect();
+      let &(ref entering, ref leaving) = window.step(dx, dz).unwrap();
+      let entering: HashSet<Chunk> = translate(entering, &c1).into_iter().collect();
+      let leaving: HashSet<Chunk> = translate(leaving, &c0).into_iter().collect();
+      assert_eq!(entering, new.difference(&old).cloned().collect());
+      assert_eq!(leaving, old.difference(&new).cloned().collect());
+    }
+  }
+
+  #[test]
+  fn world_move_eye_keeps_window_bounded() {
+    let mut world = World::new(&Point2::new(0.0, 0.0), 2.0 * CHUNK_SIZE as f32);
+    let window_size = world.window.offsets.len();
+    world.take_requests();
+
+    world.move_eye(&Point2::new(CHUNK_SIZE as f32, 0.0));
+    let entering = world.take_requests();
+    let leaving = world.take_unloaded();
+    assert!(entering.contains(&Chunk::new(3, 0, 0)));
+    assert!(leaving.contains(&Chunk::new(-2, 0, 0)));
+    assert_eq!(entering.len(), leaving.len());
+
+    // Walk far away and back, crossing chunks one by one and then in a single jump.
+    for i in 2..10 {
+      world.move_eye(&Point2::new(i as f32 * CHUNK_SIZE as f32, 0.0));
+      assert_eq!(world.pending.len() + world.chunks.len(), window_size);
+    }
+    world.move_eye(&Point2::new(0.0, 0.0));
+    assert_eq!(world.pending.len() + world.chunks.len(), window_size);
+    assert!(world.contains_chunk(&Chunk::new(0, 0, 0)).not());
+    assert_eq!(world.len(), 0);
+  }
 }
@@ -10,7 +10,8 @@ use std::sync::{Mutex, Once, ONCE_INIT};
 use std::sync::atomic::{AtomicBool, Ordering};
 
 use gl;
-use x11::key::{ElementState, ScanCode, VirtualKeyCode};
+use x11::key::ScanCode;
+pub use x11::key::{ElementState, VirtualKeyCode};
 
 mod key;
 
@@ -475,16 +476,21 @@ fn set_detectable_auto_repeat(display: *mut Display) {
 }
 
 fn get_proc_address(proc_name: &str) -> GLXextFuncPtr {
-  let c_proc_name = CString::new(proc_name).unwrap();
-  let maybe_address = unsafe {
-    glXGetProcAddress(c_proc_name.as_ptr() as *const u8)
-  };
-  match maybe_address {
+  match try_get_proc_address(proc_name) {
     Some(p) => p,
     None => panic!("glXGetProcAddress({}) failed", proc_name),
   }
 }
 
+/// Like `get_proc_address`, `None` for missing entry points instead of panicking.  For optional
+/// extension functions, which have fallbacks.
+pub fn try_get_proc_address(proc_name: &str) -> Option<extern "system" fn()> {
+  let c_proc_name = CString::new(proc_name).unwrap();
+  unsafe {
+    glXGetProcAddress(c_proc_name.as_ptr() as *const u8)
+  }
+}
+
 #[cfg(debug_assertions)]
 fn create_context_attribs(display: *mut Display, config: GLXFBConfig, share_context: GLXContext,
   direct: bool, attrib_list: &[c_int]) -> GLXContext {